@@ -0,0 +1,44 @@
+#!/bin/sh
+# Writes the generated part of the benchmark corpus into the directory given as
+# the first argument.
+#
+#   opchain.k  A definition whose body is one chain of 5000 binary operators,
+#              which makes a 5000 deep AST.
+#   library.k  10000 definitions and a call to the last one.  Each definition
+#              past the first 100 calls one of those, so that looking up a
+#              function never has to link a long chain of modules.
+#   externs.k  20 libm functions declared with extern and 5000 definitions
+#              that call 4 of them each, so that every module is linked
+#              against host symbols.
+
+OUT=${1:-.}
+
+awk -v n=5000 'BEGIN {
+  printf "def chain(x)\n  x"
+  for (i = 1; i <= n; i++) {
+    printf " %s x*%d", (i % 2 ? "+" : "-"), i % 7 + 1
+    if (i % 10 == 0)
+      printf "\n "
+  }
+  printf ";\n\nchain(1);\n"
+}' > "$OUT/opchain.k"
+
+awk -v n=10000 'BEGIN {
+  for (i = 0; i < 100; i++)
+    printf "def f%d(x) x*%d+1;\n", i, i
+  for (; i < n; i++)
+    printf "def f%d(x) f%d(x)+%d;\n", i, i % 100, i
+  printf "f%d(1);\n", n - 1
+}' > "$OUT/library.k"
+
+awk -v n=5000 'BEGIN {
+  split("tan atan sinh cosh tanh asin acos cbrt expm1 log1p erf erfc " \
+        "tgamma lgamma asinh acosh atanh j0 logb j1", f, " ")
+  for (i = 1; i <= 20; i++)
+    printf "extern %s(x);\n", f[i]
+  for (i = 0; i < n; i++)
+    printf "def g%d(x) %s(x) + %s(x) + %s(x) + %s(x);\n", i,
+      f[i % 20 + 1], f[(i + 5) % 20 + 1], f[(i + 10) % 20 + 1],
+      f[(i + 15) % 20 + 1]
+  printf "g%d(0.5);\n", n - 1
+}' > "$OUT/externs.k"
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Runs the benchmark corpus through a binary without and with --pipeline and
+# checks that both print the same.  The prompts are left out of the comparison,
+# since --pipeline prints them as soon as it reads the next item.
+#
+#   ./pipeline.sh <binary> [options passed to the binary]
+#
+# Prints a line for each program, with the start of the differences if there
+# are any, and exits with 1 if any program's output differs.
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 <binary> [options]" 1>&2
+  exit 1
+fi
+
+BINARY=$1
+shift
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+"$HERE/gen.sh" "$WORK"
+cp "$HERE"/fib.k "$HERE"/mandel.k "$HERE"/integrate.k "$HERE"/trig.k \
+   "$HERE"/output.k "$WORK"
+
+STATUS=0
+for NAME in fib mandel integrate trig output opchain library externs; do
+  SRC="$WORK/$NAME.k"
+  "$BINARY" "$@" < "$SRC" 2>&1 | sed 's/ready> //g' > "$WORK/serial.txt"
+  "$BINARY" "$@" --pipeline < "$SRC" 2>&1 | sed 's/ready> //g' \
+    > "$WORK/pipeline.txt"
+  if cmp -s "$WORK/serial.txt" "$WORK/pipeline.txt"; then
+    echo "$NAME: same ($(wc -l < "$WORK/serial.txt" | tr -d ' ') lines)"
+  else
+    echo "$NAME: DIFFERENT"
+    diff "$WORK/serial.txt" "$WORK/pipeline.txt" | head -20
+    STATUS=1
+  fi
+done
+exit $STATUS
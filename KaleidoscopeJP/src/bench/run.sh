@@ -0,0 +1,82 @@
+#!/bin/bash
+# Runs the benchmark corpus against one chapter's binary and prints the result
+# as JSON on stdout.
+#
+#   ./run.sh <binary> [options passed to the binary]
+#
+# REPEAT (default 3) sets how many times each program is run.  When the binary
+# understands --time-phases (chap07), the per-phase times of the last run are
+# included as well.
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 <binary> [options]" 1>&2
+  exit 1
+fi
+
+BINARY=$1
+shift
+REPEAT=${REPEAT:-3}
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+"$HERE/gen.sh" "$WORK"
+cp "$HERE"/fib.k "$HERE"/mandel.k "$HERE"/integrate.k "$HERE"/trig.k \
+   "$HERE"/output.k "$WORK"
+
+# Older chapters read the program from stdin and know no options.
+PHASES=0
+if "$BINARY" --help < /dev/null 2>&1 | grep -q -- --time-phases; then
+  PHASES=1
+fi
+
+TIMEFORMAT=%R
+FIRST=1
+
+printf '{"binary":"%s","args":"%s","date":"%s","host":"%s","benchmarks":[' \
+  "$BINARY" "$*" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -n)"
+
+for NAME in fib mandel integrate trig output opchain library externs; do
+  SRC="$WORK/$NAME.k"
+  BYTES=$(wc -c < "$SRC" | tr -d ' ')
+  RUNS=""
+  for ((i = 0; i < REPEAT; i++)); do
+    rm -f "$WORK/phases.json"
+    if [ $PHASES -eq 1 ]; then
+      T=$( { time "$BINARY" "$@" --time-phases \
+               --time-phases-file="$WORK/phases.json" \
+               < "$SRC" > "$WORK/out.txt" 2>&1; } 2>&1 )
+    else
+      T=$( { time "$BINARY" "$@" < "$SRC" > "$WORK/out.txt" 2>&1; } 2>&1 )
+    fi
+    RUNS="$RUNS${RUNS:+,}$T"
+  done
+  ERRORS=$(grep -c Error "$WORK/out.txt")
+
+  [ $FIRST -eq 1 ] || printf ','
+  FIRST=0
+  printf '\n  {"name":"%s","bytes":%s,"runs":[%s],"wall_s_min":%s,"errors":%s' \
+    "$NAME" "$BYTES" "$RUNS" \
+    "$(echo "$RUNS" | tr ',' '\n' | sort -n | head -1)" "$ERRORS"
+
+  # The summary lines look like {"phase":"parse","count":...,"total_ns":...}.
+  if [ -f "$WORK/phases.json" ]; then
+    awk -v bytes="$BYTES" '
+      /^\{"phase":/ {
+        split($0, f, "\"")
+        match($0, /"total_ns":[0-9]+/)
+        ns = substr($0, RSTART + 11, RLENGTH - 11)
+        list = list (list == "" ? "" : ",") "\"" f[4] "\":" ns
+        if (f[4] == "parse")
+          parse = ns
+      }
+      END {
+        printf ",\"phases_ns\":{%s}", list
+        if (parse > 0)
+          printf ",\"parse_mb_per_s\":%.2f", bytes * 1000 / parse
+      }' "$WORK/phases.json"
+  fi
+  printf '}'
+done
+
+printf '\n]}\n'
@@ -0,0 +1,45 @@
+#!/bin/bash
+# Evaluates many top-level expressions in one session and samples the resident
+# set size of the binary while it runs.  Prints the result as JSON on stdout.
+#
+#   ./soak.sh <binary> [options passed to the binary]
+#
+# COUNT (default 200000) sets the number of expressions.  Every expression has
+# constants of its own, so the RSS keeps growing if anything made for an
+# expression outlives it.
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 <binary> [options]" 1>&2
+  exit 1
+fi
+
+BINARY=$1
+shift
+COUNT=${COUNT:-200000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+awk -v n="$COUNT" 'BEGIN {
+  for (i = 1; i <= n; i++)
+    printf "var a = %d.5 in a * a + %d.25;\n", i, i
+}' > "$WORK/soak.k"
+
+"$BINARY" "$@" < "$WORK/soak.k" > /dev/null 2>&1 &
+PID=$!
+
+START=$(date +%s)
+SAMPLES=""
+MAX=0
+while kill -0 $PID 2> /dev/null; do
+  RSS=$(ps -o rss= -p $PID | tr -d ' ')
+  if [ -n "$RSS" ]; then
+    SAMPLES="$SAMPLES${SAMPLES:+,}[$(($(date +%s) - START)),$RSS]"
+    [ "$RSS" -gt $MAX ] && MAX=$RSS
+  fi
+  sleep 1
+done
+wait $PID
+
+printf '{"binary":"%s","args":"%s","expressions":%s,"seconds":%s,' \
+  "$BINARY" "$*" "$COUNT" "$(($(date +%s) - START))"
+printf '"rss_kb_max":%s,"samples":[%s]}\n' "$MAX" "$SAMPLES"
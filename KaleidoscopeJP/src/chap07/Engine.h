@@ -0,0 +1,312 @@
+//===- Engine.h - Kaleidoscope as a library ---------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The interface for programs that embed the Kaleidoscope compiler and call the
+// functions it defines directly, without the REPL.  Link with libkaleido, which
+// is main.cpp built with KALEIDO_LIBRARY defined.
+//
+//   kaleido::Engine E;
+//   if (!E.compile("def add(x y) x + y;"))
+//     fprintf(stderr, "%s", E.getError().c_str());
+//   auto Add = E.get<double(double, double)>("add");
+//   double Sum = Add(1, 2);
+//
+// An expression that is run many times with different values is compiled
+// once with placeholders for them:
+//
+//   auto Dist = E.prepare<double(double, double)>("x*x + y*y", {"x", "y"});
+//   double D = Dist(3, 4);
+//   Dist.release(); // Or let it go out of scope.
+//
+// Other threads may call the functions while this one compiles, through
+// snapshots:
+//
+//   E.shareFunctions();
+//   // On another thread:
+//   kaleido::Snapshot S = E.snapshot();
+//   double Sum = S.get<double(double, double)>("add")(1, 2);
+//
+// A function of the program can be called from Kaleidoscope code that
+// declares it with 'extern':
+//
+//   E.registerFunction("clamp", clamp, kaleido::Engine::ReadNone);
+//   E.compile("extern clamp(x); clamp(2);");
+//
+// It uses nothing from LLVM, so the program does not need LLVM's headers.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDO_ENGINE_H
+#define KALEIDO_ENGINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+namespace kaleido {
+
+namespace detail {
+
+/// TypeCode - The letter that stands for T in a signature.  These are the host
+/// types of the Kaleidoscope types: double, int and bool, and an array, which
+/// is passed as its data and its length.
+template <typename T> struct TypeCode {
+  static_assert(sizeof(T) == 0, "Kaleidoscope functions only take and return "
+                                "double, int64_t and bool, and arrays as "
+                                "double * followed by int64_t");
+};
+template <> struct TypeCode<double> { static constexpr char Value = 'd'; };
+template <> struct TypeCode<int64_t> { static constexpr char Value = 'i'; };
+template <> struct TypeCode<bool> { static constexpr char Value = 'b'; };
+template <> struct TypeCode<double *> { static constexpr char Value = 'p'; };
+
+/// Signature - The return type and then the argument types of a function type,
+/// as TypeCode letters.
+template <typename Fn> struct Signature;
+template <typename R, typename... Args> struct Signature<R(Args...)> {
+  static const char *get() {
+    static const char Codes[] = {TypeCode<R>::Value, TypeCode<Args>::Value...,
+                                 '\0'};
+    return Codes;
+  }
+};
+
+} // end namespace detail
+
+template <typename Fn> class Callable;
+
+/// Callable - A function compiled by an Engine, called with the signature it
+/// was looked up with.  It calls the function's stub, so it calls the newest
+/// definition after the function is redefined with the same prototype.  It is
+/// empty if the lookup failed.
+template <typename R, typename... Args> class Callable<R(Args...)> {
+public:
+  typedef R (*Pointer)(Args...);
+
+  Callable() = default;
+  explicit Callable(Pointer Fn) : Fn(Fn) {}
+
+  explicit operator bool() const { return Fn != nullptr; }
+  R operator()(Args... A) const { return Fn(A...); }
+  Pointer getPointer() const { return Fn; }
+
+private:
+  Pointer Fn = nullptr;
+};
+
+class Engine;
+
+/// Prepared - An expression compiled by Engine::prepare.  Calling it runs the
+/// expression with the arguments as the values of its parameters, without
+/// compiling anything.  It holds a reference to the code, which it gives up
+/// when it is destroyed or released, so it can be moved but not copied.
+template <typename Fn> class Prepared : public Callable<Fn> {
+public:
+  Prepared() = default;
+  Prepared(const Prepared &) = delete;
+  Prepared &operator=(const Prepared &) = delete;
+  Prepared(Prepared &&Other) noexcept
+      : Callable<Fn>(Other), Owner(Other.Owner), Id(Other.Id) {
+    Other.forget();
+  }
+  Prepared &operator=(Prepared &&Other) noexcept {
+    if (this != &Other) {
+      release();
+      Callable<Fn>::operator=(Other);
+      Owner = Other.Owner;
+      Id = Other.Id;
+      Other.forget();
+    }
+    return *this;
+  }
+  ~Prepared() { release(); }
+
+  /// release - Give up the code and become empty.  The code of an expression
+  /// is freed when every prepare that returned it has been released.
+  void release();
+
+private:
+  friend class Engine;
+  Prepared(Callable<Fn> C, Engine *Owner, unsigned Id)
+      : Callable<Fn>(C), Owner(Owner), Id(Id) {}
+
+  void forget() {
+    Callable<Fn>::operator=(Callable<Fn>());
+    Owner = nullptr;
+    Id = 0;
+  }
+
+  Engine *Owner = nullptr;
+  unsigned Id = 0;
+};
+
+/// Snapshot - The functions of an Engine as they were at one moment, for a
+/// thread that calls them while another thread compiles.  Calls go through
+/// the stubs, so they run the newest definitions, and every body they can
+/// reach stays loaded while the Snapshot exists.  A thread should take a new
+/// one from time to time, so that the bodies that were replaced can be freed.
+class Snapshot {
+public:
+  Snapshot() = default;
+
+  /// get - Return the function Name, whose prototype must match Fn as for
+  /// Engine::get.  Returns an empty Callable if it has no such function.
+  template <typename Fn> Callable<Fn> get(const std::string &Name) const {
+    uint64_t Addr = lookup(Name, detail::Signature<Fn>::get());
+    return Callable<Fn>((typename Callable<Fn>::Pointer)(intptr_t)Addr);
+  }
+
+private:
+  friend class Engine;
+  uint64_t lookup(const std::string &Name, const char *Signature) const;
+
+  std::shared_ptr<const void> Table;
+};
+
+/// Engine - The Kaleidoscope compiler and its JIT.  The compiler keeps its
+/// state in globals, so a process can have only one Engine at a time.
+class Engine {
+public:
+  Engine();
+  /// ~Engine - Free the code of every function and forget them, so that
+  /// another Engine can be made.  Every Callable, Prepared and Snapshot of
+  /// this one must have been dropped.
+  ~Engine();
+  Engine(const Engine &) = delete;
+  Engine &operator=(const Engine &) = delete;
+
+  /// compile - Compile the definitions and externs in Source, and run its
+  /// top-level expressions, in order.  Returns false if any of them had an
+  /// error, and getError says which.  The rest are still compiled.  A runtime
+  /// error, like an array index out of bounds, stops its expression and is
+  /// one of these errors; in a function called through a Callable, it ends
+  /// the process.  An empty Source, which may be null, compiles nothing.
+  bool compile(const char *Source, size_t Length);
+  bool compile(const char *Source) {
+    return compile(Source, Source ? strlen(Source) : 0);
+  }
+  bool compile(const std::string &Source) {
+    return compile(Source.data(), Source.size());
+  }
+#if __cplusplus >= 201703L
+  bool compile(std::string_view Source) {
+    return compile(Source.data(), Source.size());
+  }
+#endif
+
+  /// get - Return the function Name, whose prototype must match Fn, e.g.
+  /// double(double, double) for 'def f(x y)'.  Fn is checked at compile time
+  /// for types that Kaleidoscope does not have, and against the prototype
+  /// here.  Returns an empty Callable and sets the error if it does not match.
+  template <typename Fn> Callable<Fn> get(const std::string &Name) {
+    uint64_t Addr = lookup(Name, detail::Signature<Fn>::get());
+    return Callable<Fn>((typename Callable<Fn>::Pointer)(intptr_t)Addr);
+  }
+
+  /// prepare - Compile Expr, an expression in which the names in Params stand
+  /// for the arguments of Fn, in order.  Preparing the same expression with the
+  /// same parameters and Fn again shares the code compiled the first time,
+  /// unless a function that it calls has been defined or declared since.
+  /// Returns an empty Prepared and sets the error if Expr has an error.
+  template <typename Fn>
+  Prepared<Fn> prepare(const std::string &Expr,
+                       const std::vector<std::string> &Params) {
+    unsigned Id = 0;
+    uint64_t Addr = prepareExpr(Expr, Params, detail::Signature<Fn>::get(), Id);
+    if (!Addr)
+      return Prepared<Fn>();
+    return Prepared<Fn>(
+        Callable<Fn>((typename Callable<Fn>::Pointer)(intptr_t)Addr), this,
+        Id);
+  }
+
+  /// release - The same as P.release().
+  template <typename Fn> void release(Prepared<Fn> &P) { P.release(); }
+
+  /// FunctionAttributes - What the compiler may assume about a function given
+  /// to registerFunction, as flags.
+  enum FunctionAttributes : unsigned {
+    NoAttributes = 0,
+    /// NoUnwind - It does not throw.
+    NoUnwind = 1,
+    /// ReadOnly - It writes no memory that Kaleidoscope code can see, so calls
+    /// with no store between them can be merged.  Implies NoUnwind.
+    ReadOnly = 2 | NoUnwind,
+    /// ReadNone - Its result depends only on its arguments, so calls with the
+    /// same arguments can be merged and hoisted out of loops.  Implies
+    /// NoUnwind.
+    ReadNone = 4 | NoUnwind,
+    /// Cold - It is rarely called, like an error handler, so the paths that
+    /// call it are laid out and optimized as unlikely.
+    Cold = 8
+  };
+
+  /// registerFunction - Let Kaleidoscope code call the function Fn of this
+  /// program as Name, after declaring it with 'extern' and a prototype that
+  /// matches Fn as for get.  Calls to it get Attrs, unless Name is defined with
+  /// 'def', which replaces it.  Register it before compiling code that uses
+  /// it.
+  template <typename Fn>
+  bool registerFunction(const std::string &Name, Fn *Address,
+                        unsigned Attrs = NoUnwind) {
+    return registerFunction(Name, reinterpret_cast<void *>(Address),
+                            detail::Signature<Fn>::get(), Attrs);
+  }
+
+  /// registerFunction - Like the template, with the signature given as
+  /// TypeCode letters, the return type first, e.g. "dd" for double(double)
+  /// and "dpi" for double(double *, int64_t).  Returns false and sets the
+  /// error if the signature is not one that Kaleidoscope has.
+  bool registerFunction(const std::string &Name, void *Address,
+                        const char *Signature, unsigned Attrs);
+
+  /// shareFunctions - Let other threads call the functions defined so far and
+  /// from now on, through snapshot.  Every definition then copies the table of
+  /// functions, so it is off until this is called.
+  void shareFunctions();
+
+  /// snapshot - The functions as they are now.  Unlike the other methods, it
+  /// may be called from any thread once shareFunctions has been called.
+  Snapshot snapshot() const;
+
+  /// getPreparedCount - The number of prepared expressions whose code is
+  /// loaded.
+  size_t getPreparedCount() const;
+
+  /// getError - The errors of the last compile, get or prepare that failed, one
+  /// per line.
+  const std::string &getError() const { return Error; }
+
+private:
+  template <typename Fn> friend class Prepared;
+
+  uint64_t lookup(const std::string &Name, const char *Signature);
+  uint64_t prepareExpr(const std::string &Expr,
+                       const std::vector<std::string> &Params,
+                       const char *Signature, unsigned &Id);
+  void releaseExpr(unsigned Id);
+
+  std::string Error;
+};
+
+template <typename Fn> void Prepared<Fn>::release() {
+  if (Owner)
+    Owner->releaseExpr(Id);
+  forget();
+}
+
+} // end namespace kaleido
+
+#endif
@@ -1,3 +1,7 @@
 LLVM_CONFIG="<path to llvm-config>"
 clang++ -c ./main.cpp -o ./main.o `${LLVM_CONFIG} --cxxflags`
-clang++ -o ./a.out ./main.o `${LLVM_CONFIG} --ldflags --libs --libfiles --system-libs`
\ No newline at end of file
+clang++ -o ./a.out ./main.o `${LLVM_CONFIG} --ldflags --libs --libfiles --system-libs`
+clang++ -c ./main.cpp -o ./kaleido.o -DKALEIDO_LIBRARY `${LLVM_CONFIG} --cxxflags`
+ar rcs ./libkaleido.a ./kaleido.o
+clang++ -o ./callers ./callers.cpp ./libkaleido.a `${LLVM_CONFIG} --cxxflags --ldflags --libs --libfiles --system-libs`
+clang++ -o ./embed ./embed.cpp ./libkaleido.a `${LLVM_CONFIG} --cxxflags --ldflags --libs --libfiles --system-libs`
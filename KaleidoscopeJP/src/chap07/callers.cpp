@@ -0,0 +1,105 @@
+//===- callers.cpp - Call Kaleidoscope functions while they are redefined -===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Checks that functions can be called from other threads while the Engine
+// redefines them.  The main thread defines f(x) as x + k for k = 1, 2, ...
+// and every so often redefines g, which calls f, in another form.  The caller
+// threads keep calling g(1) through snapshots and check that it is 2 * (1 + k)
+// for a k that never goes down.
+//
+//   ./callers [threads] [definitions]
+//
+// Exits with 1 and says which call went wrong if any did.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Engine.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::atomic<bool> Stop(false);
+static std::atomic<bool> Failed(false);
+
+/// callG - The body of a caller thread.  Counts its calls in Count.
+static void callG(const kaleido::Engine &E, unsigned Thread, uint64_t *Count) {
+  uint64_t N = 0;
+  double Last = 0;
+  while (!Stop && !Failed) {
+    kaleido::Snapshot S = E.snapshot();
+    auto G = S.get<double(double)>("g");
+    if (!G) {
+      fprintf(stderr, "thread %u: g is not in the snapshot\n", Thread);
+      Failed = true;
+      break;
+    }
+    for (unsigned i = 0; i != 100; ++i, ++N) {
+      double Result = G(1);
+      double K = Result / 2 - 1;
+      if (K < 1 || K != (double)(int64_t)K || Result < Last) {
+        fprintf(stderr, "thread %u: g(1) is %g after %g\n", Thread, Result,
+                Last);
+        Failed = true;
+        break;
+      }
+      Last = Result;
+    }
+  }
+  *Count = N;
+}
+
+int main(int argc, char **argv) {
+  unsigned Threads = argc > 1 ? atoi(argv[1]) : 4;
+  unsigned Definitions = argc > 2 ? atoi(argv[2]) : 500;
+
+  kaleido::Engine E;
+  E.shareFunctions();
+  if (!E.compile("def f(x) x + 1; def g(x) f(x) * 2;")) {
+    fprintf(stderr, "%s", E.getError().c_str());
+    return 1;
+  }
+
+  std::vector<std::thread> Callers;
+  std::vector<uint64_t> Counts(Threads);
+  for (unsigned i = 0; i != Threads; ++i)
+    Callers.emplace_back(callG, std::cref(E), i, &Counts[i]);
+
+  for (unsigned k = 2; k <= Definitions && !Failed; ++k) {
+    std::string Source = "def f(x) x + " + std::to_string(k) + ";";
+    // Redefine the caller as well, so that its old bodies are freed too.
+    if (k % 10 == 0)
+      Source += k % 20 ? "def g(x) 2 * f(x);" : "def g(x) f(x) * 2;";
+    if (!E.compile(Source)) {
+      fprintf(stderr, "%s", E.getError().c_str());
+      Failed = true;
+    }
+  }
+
+  Stop = true;
+  uint64_t Total = 0;
+  for (unsigned i = 0; i != Threads; ++i) {
+    Callers[i].join();
+    Total += Counts[i];
+  }
+
+  // Every thread is done, so the last definition is the one that runs.
+  double Result = E.snapshot().get<double(double)>("g")(1);
+  if (!Failed && Result != 2.0 * (1 + Definitions)) {
+    fprintf(stderr, "g(1) is %g at the end\n", Result);
+    Failed = true;
+  }
+  fprintf(stderr, "%u threads made %llu calls during %u definitions: %s\n",
+          Threads, (unsigned long long)Total, Definitions,
+          Failed ? "FAILED" : "ok");
+  return Failed ? 1 : 0;
+}
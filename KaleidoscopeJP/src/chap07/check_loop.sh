@@ -0,0 +1,60 @@
+#!/bin/bash
+# Checks the shape of the IR that a for loop compiles to, on saxpy in loop.k,
+# before any pass has changed it:
+#   * a preheader that only branches to the loop header,
+#   * a header with two predecessors, the preheader and a single latch,
+#   * an induction variable incremented with add nsw,
+#   * a loopexit block that only the latch branches to.
+#
+#   ./check_loop.sh <binary>
+#
+# Prints what is missing and exits with 1 if the shape is wrong.
+
+if [ $# -ne 1 ]; then
+  echo "usage: $0 <binary>" 1>&2
+  exit 1
+fi
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+# -print-before=mem2reg is an LLVM option: it prints each function as the
+# front end generated it, before the first pass runs.
+IR=$("$1" -print-before=mem2reg < "$HERE/loop.k" 2>&1 |
+  sed -n '/IR Dump Before/,$p' | sed -n '/^define .*@saxpy(/,/^}/p')
+if [ -z "$IR" ]; then
+  echo "saxpy: no IR printed" 1>&2
+  exit 1
+fi
+
+STATUS=0
+fail() {
+  echo "saxpy: $1" 1>&2
+  STATUS=1
+}
+
+# The preheader holds nothing but the branch to the header.
+echo "$IR" | awk '/^preheader:/ { getline; print; exit }' |
+  grep -q '^  br label %loop$' || fail "no preheader that only enters the loop"
+
+# The header is reached from the preheader and from one latch.
+HEADER_PREDS=$(echo "$IR" | sed -n 's/^loop: *; preds = //p')
+[ "$(echo "$HEADER_PREDS" | tr ',' '\n' | grep -c .)" = 2 ] &&
+  echo "$HEADER_PREDS" | grep -q '%preheader' ||
+  fail "the header is not reached from the preheader and one latch"
+LATCH=$(echo "$HEADER_PREDS" | tr ',' '\n' | tr -d ' %' | grep -v '^preheader$')
+[ "$(echo "$IR" | grep -c 'label %loop\b')" = 2 ] ||
+  fail "more than one backedge"
+
+# The latch increments the variable without signed wrap, and leaves through a
+# dedicated exit.
+echo "$IR" | grep -q '%nextvar = add nsw i64 %i, 1' ||
+  fail "no add nsw induction variable"
+echo "$IR" |
+  awk -v L="$LATCH" '$1 == L ":" { f = 1 } f && /^  br / { print; exit }' |
+  grep -q 'label %loop, label %loopexit' ||
+  fail "the latch does not exit to loopexit"
+[ "$(echo "$IR" | sed -n 's/^loopexit: *; preds = //p')" = "%$LATCH" ] ||
+  fail "loopexit is reached from more than the latch"
+
+[ $STATUS = 0 ] && echo "saxpy: loop shape ok"
+exit $STATUS
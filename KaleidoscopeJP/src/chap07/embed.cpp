@@ -0,0 +1,132 @@
+//===- embed.cpp - Use the Kaleidoscope compiler through Engine.h ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Goes through what Engine.h offers and checks the results: compile, get,
+// prepare and what frees it, registerFunction, the errors that getError
+// reports, including runtime errors, and making a new Engine after the old one
+// is gone.
+//
+//   ./embed
+//
+// Exits with 1 and says which check went wrong if any did.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Engine.h"
+#include <cstdio>
+#include <string>
+#include <utility>
+
+static bool Failed = false;
+
+/// check - Report the check What if it did not hold.
+static void check(bool Holds, const char *What) {
+  if (!Holds) {
+    fprintf(stderr, "FAILED: %s\n", What);
+    Failed = true;
+  }
+}
+
+/// hasError - Whether the errors of E mention Text.
+static bool hasError(const kaleido::Engine &E, const char *Text) {
+  return E.getError().find(Text) != std::string::npos;
+}
+
+static bool isNegative(int64_t X) { return X < 0; }
+static double failed(double X) { return -X; }
+
+/// useEngine - Check one Engine from start to end.
+static void useEngine() {
+  kaleido::Engine E;
+  check(E.registerFunction("isneg", isNegative), "registerFunction");
+  check(E.registerFunction("failed", failed,
+                           kaleido::Engine::NoUnwind | kaleido::Engine::Cold),
+        "registerFunction with Cold");
+
+  check(E.compile("def add(x y) x + y;"
+                  "extern isneg(x:int):bool;"
+                  "def sign(x:int):bool isneg(x);"
+                  "def at(n) var a = array(3) in a[n];"
+                  "extern failed(x);"
+                  "def safe(x) if x < 0 then failed(x) else x;"),
+        "compile definitions");
+  auto Add = E.get<double(double, double)>("add");
+  check(Add && Add(1, 2) == 3, "get add");
+  auto Sign = E.get<bool(int64_t)>("sign");
+  check(Sign && Sign(-5) && !Sign(5), "bool through a host function");
+  auto Safe = E.get<double(double)>("safe");
+  check(Safe && Safe(-2) == 2 && Safe(3) == 3, "cold host function");
+
+  check(!E.get<double(double)>("add"), "get with the wrong signature");
+  check(hasError(E, "does not have the requested signature"),
+        "get error message");
+  check(!E.get<double(double)>("nothing"), "get an undefined function");
+
+  // The other expressions still run after one has a runtime error.
+  check(!E.compile("at(1); at(3); def ok(x) x; at(0.5);"), "runtime errors");
+  check(hasError(E, "array index 3 is out of bounds"), "bounds error");
+  check(hasError(E, "array index 0.5 is not a whole number"), "index error");
+  check(bool(E.get<double(double)>("ok")), "compile after a runtime error");
+  check(!E.compile("def (x) x;") && hasError(E, "Expected function name"),
+        "syntax error");
+  // Empty text compiles nothing, and must not read the standard input of
+  // the program instead.
+  check(E.compile("") && E.compile(nullptr, 0) &&
+            E.compile(static_cast<const char *>(nullptr)),
+        "empty source");
+#if __cplusplus >= 201703L
+  check(E.compile(std::string_view{}), "empty string_view");
+#endif
+
+  auto Dist = E.prepare<double(double, double)>("x*x + y*y", {"x", "y"});
+  check(Dist && Dist(3, 4) == 25, "prepare");
+  {
+    auto Again = E.prepare<double(double, double)>("x*x+y*y", {"x", "y"});
+    check(E.getPreparedCount() == 1, "prepare shares the code");
+  }
+  check(Dist && E.getPreparedCount() == 1, "destroy one of two");
+  kaleido::Prepared<double(double, double)> Moved = std::move(Dist);
+  check(!Dist && Moved(1, 1) == 2, "move");
+  Moved.release();
+  check(!Moved && E.getPreparedCount() == 0, "release the last");
+  check(!E.prepare<double(double)>("x +", {"x"}), "prepare a bad expression");
+
+  // Defining a function that a prepared expression calls compiles the
+  // expression again.  The old code stays until it is released, and calls the
+  // new definition through the stub.
+  check(E.compile("def twice(x) 2 * x;"), "def twice");
+  auto Twice = E.prepare<double(double)>("twice(x)", {"x"});
+  check(E.compile("def twice(x) x + x + 1;"), "redefine twice");
+  auto NewTwice = E.prepare<double(double)>("twice(x)", {"x"});
+  check(Twice(4) == 9 && NewTwice(4) == 9, "prepare after a redefinition");
+  check(E.getPreparedCount() == 2, "the old code is kept");
+
+  // Calls to sqrt after 'extern sqrt' are compiled to the llvm.sqrt
+  // intrinsic, which a definition could not replace, so it is refused.
+  check(E.compile("extern sqrt(x);"), "extern sqrt");
+  auto Sqrt = E.prepare<double(double)>("sqrt(x)", {"x"});
+  check(!E.compile("def sqrt(x) x + 1;") &&
+            hasError(E, "compiled as an intrinsic"),
+        "def of an intrinsic");
+  check(Sqrt(4) == 2, "the intrinsic stays");
+}
+
+int main() {
+  useEngine();
+  // The first Engine defined everything, so a second one starting afresh
+  // must not know any of it.
+  useEngine();
+  {
+    kaleido::Engine E;
+    check(!E.compile("add(1, 2);") && hasError(E, "Unknown function"),
+          "a new Engine forgets the old functions");
+  }
+  fprintf(stderr, "embed: %s\n", Failed ? "FAILED" : "ok");
+  return Failed ? 1 : 0;
+}
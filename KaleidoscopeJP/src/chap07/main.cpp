@@ -1,32 +1,57 @@
 #include "../include/KaleidoscopeJIT.h"
+#include "Engine.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Vectorize.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <csetjmp>
+#include <cstdarg>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -68,17 +93,53 @@ enum Token {
 static std::string IdentifierStr; // Filled in if tok_identifier
 static double NumVal;             // Filled in if tok_number
 
+/// SourceLocation - A line and column in the input, for debug info.
+struct SourceLocation {
+  int Line;
+  int Col;
+};
+static SourceLocation CurLoc;
+static SourceLocation LexLoc = {1, 0};
+
+/// ReadingSource - Whether the lexer reads the text given to Engine::compile
+/// instead of standard input.  SourceCur and SourceEnd are the rest of that
+/// text, and may both be null when it is empty.
+static bool ReadingSource = false;
+static const char *SourceCur = nullptr;
+static const char *SourceEnd = nullptr;
+
+/// advance - Read the next character of the input, keeping track of where it
+/// is.
+static int advance() {
+  int LastChar;
+  if (!ReadingSource)
+    LastChar = getchar();
+  else if (SourceCur == SourceEnd)
+    LastChar = EOF;
+  else
+    LastChar = (unsigned char)*SourceCur++;
+
+  if (LastChar == '\n' || LastChar == '\r') {
+    LexLoc.Line++;
+    LexLoc.Col = 0;
+  } else
+    LexLoc.Col++;
+  return LastChar;
+}
+
 /// gettok - Return the next token from standard input.
 static int gettok() {
   static int LastChar = ' ';
 
   // Skip any whitespace.
   while (isspace(LastChar))
-    LastChar = getchar();
+    LastChar = advance();
+
+  CurLoc = LexLoc;
 
   if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
     IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
+    while (isalnum((LastChar = advance())))
       IdentifierStr += LastChar;
 
     if (IdentifierStr == "def")
@@ -108,7 +169,7 @@ static int gettok() {
     std::string NumStr;
     do {
       NumStr += LastChar;
-      LastChar = getchar();
+      LastChar = advance();
     } while (isdigit(LastChar) || LastChar == '.');
 
     NumVal = strtod(NumStr.c_str(), nullptr);
@@ -118,20 +179,23 @@ static int gettok() {
   if (LastChar == '#') {
     // Comment until end of line.
     do
-      LastChar = getchar();
+      LastChar = advance();
     while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
     if (LastChar != EOF)
       return gettok();
   }
 
-  // Check for end of file.  Don't eat the EOF.
-  if (LastChar == EOF)
+  // Check for end of file.  Start over on the next call, which reads the next
+  // input given to Engine::compile.
+  if (LastChar == EOF) {
+    LastChar = ' ';
     return tok_eof;
+  }
 
   // Otherwise, just return the character as its ascii value.
   int ThisChar = LastChar;
-  LastChar = getchar();
+  LastChar = advance();
   return ThisChar;
 }
 
@@ -141,12 +205,72 @@ static int gettok() {
 
 namespace {
 
+/// ValueType - The types a value can have.  Anything that is not annotated
+/// with ':int', ':bool' or ':array' is a double, except that 'var' and 'for'
+/// variables without an annotation (type_infer) take the type of their initial
+/// value when that is safe.  An array is a pointer to doubles owned by the host
+/// together with its length.
+enum ValueType { type_infer, type_double, type_int, type_bool, type_array };
+
+/// TypeScope - The types of the variables in scope while simplifying.  A
+/// variable whose type is only found during codegen maps to type_infer.
+typedef std::map<std::string, ValueType> TypeScope;
+
 /// ExprAST - Base class for all expression nodes.
 class ExprAST {
+protected:
+  SourceLocation Loc;
+
 public:
+  ExprAST(SourceLocation Loc = CurLoc) : Loc(Loc) {}
   virtual ~ExprAST() = default;
 
   virtual Value *codegen() = 0;
+
+  /// appendKey - Append to Key a text that is the same for two expressions
+  /// exactly when they are, and add the functions this calls to Callees.  It
+  /// is how the expression cache recognizes an expression entered again.
+  virtual void appendKey(std::string &Key,
+                         std::set<std::string> &Callees) const = 0;
+
+  /// codegenReturn - Emit this expression in tail position, returning its
+  /// value from the current function as RetTy.  Returns false on error.
+  virtual bool codegenReturn(Type *RetTy);
+
+  int getLine() const { return Loc.Line; }
+  int getCol() const { return Loc.Col; }
+
+  /// isIntegralConstant - Return true if this is a numeric literal with no
+  /// fractional part, so that it can be used as an int without changing value.
+  virtual bool isIntegralConstant() const { return false; }
+
+  /// assigns - Return true if this expression may store to the variable Name.
+  virtual bool assigns(const std::string &Name) const { return false; }
+
+  /// isVariable - Return true if this is a reference to the variable Name.
+  virtual bool isVariable(const std::string &Name) const { return false; }
+
+  /// codegenStore - Emit code storing Val to this expression, which is the
+  /// left hand side of '='.  Only variables and array elements can be stored.
+  virtual Value *codegenStore(Value *Val);
+
+  /// simplify - Simplify the operands of this expression, then fold it if
+  /// that cannot change its value or type.  Returns the expression to use in
+  /// place of this one, or null to keep it.
+  virtual std::unique_ptr<ExprAST> simplify(TypeScope &Types) {
+    return nullptr;
+  }
+
+  /// getType - Return the type this expression will have, or type_infer if
+  /// that is not known before codegen.
+  virtual ValueType getType(const TypeScope &Types) const { return type_infer; }
+
+  /// getConstant - Return true and set Val if this is a numeric literal.
+  virtual bool getConstant(double &Val) const { return false; }
+
+  /// getConstantCondition - Return true and set Result if this is a constant
+  /// used as the condition of an 'if'.
+  virtual bool getConstantCondition(bool &Result) const { return false; }
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -154,9 +278,21 @@ class NumberExprAST : public ExprAST {
   double Val;
 
 public:
-  NumberExprAST(double Val) : Val(Val) {}
+  NumberExprAST(double Val, SourceLocation Loc = CurLoc)
+      : ExprAST(Loc), Val(Val) {}
 
   Value *codegen() override;
+  void appendKey(std::string &Key,
+                 std::set<std::string> &Callees) const override;
+  bool isIntegralConstant() const override;
+  ValueType getType(const TypeScope &Types) const override {
+    return type_double;
+  }
+  bool getConstant(double &Val) const override {
+    Val = this->Val;
+    return true;
+  }
+  bool getConstantCondition(bool &Result) const override;
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
@@ -164,10 +300,42 @@ class VariableExprAST : public ExprAST {
   std::string Name;
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
+  VariableExprAST(SourceLocation Loc, const std::string &Name)
+      : ExprAST(Loc), Name(Name) {}
 
   Value *codegen() override;
-  const std::string &getName() const { return Name; }
+  void appendKey(std::string &Key,
+                 std::set<std::string> &Callees) const override;
+  bool isVariable(const std::string &Name) const override {
+    return this->Name == Name;
+  }
+  Value *codegenStore(Value *Val) override;
+  ValueType getType(const TypeScope &Types) const override;
+};
+
+/// IndexExprAST - Expression class for an array element, like "a[i]".
+class IndexExprAST : public ExprAST {
+  std::string Name;
+  std::unique_ptr<ExprAST> Index;
+
+  Value *codegenAddress();
+
+public:
+  IndexExprAST(SourceLocation Loc, const std::string &Name,
+               std::unique_ptr<ExprAST> Index)
+      : ExprAST(Loc), Name(Name), Index(std::move(Index)) {}
+
+  Value *codegen() override;
+  void appendKey(std::string &Key,
+                 std::set<std::string> &Callees) const override;
+  bool assigns(const std::string &Name) const override {
+    return Index->assigns(Name);
+  }
+  Value *codegenStore(Value *Val) override;
+  std::unique_ptr<ExprAST> simplify(TypeScope &Types) override;
+  ValueType getType(const TypeScope &Types) const override {
+    return type_double;
+  }
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
@@ -176,10 +344,17 @@ class UnaryExprAST : public ExprAST {
   std::unique_ptr<ExprAST> Operand;
 
 public:
-  UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-      : Opcode(Opcode), Operand(std::move(Operand)) {}
+  UnaryExprAST(SourceLocation Loc, char Opcode,
+               std::unique_ptr<ExprAST> Operand)
+      : ExprAST(Loc), Opcode(Opcode), Operand(std::move(Operand)) {}
 
   Value *codegen() override;
+  void appendKey(std::string &Key,
+                 std::set<std::string> &Callees) const override;
+  bool assigns(const std::string &Name) const override {
+    return Operand->assigns(Name);
+  }
+  std::unique_ptr<ExprAST> simplify(TypeScope &Types) override;
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -188,11 +363,17 @@ class BinaryExprAST : public ExprAST {
   std::unique_ptr<ExprAST> LHS, RHS;
 
 public:
-  BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
+  BinaryExprAST(SourceLocation Loc, char Op, std::unique_ptr<ExprAST> LHS,
                 std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+      : ExprAST(Loc), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
 
   Value *codegen() override;
+  void appendKey(std::string &Key,
+                 std::set<std::string> &Callees) const override;
+  bool assigns(const std::string &Name) const override;
+  std::unique_ptr<ExprAST> simplify(TypeScope &Types) override;
+  ValueType getType(const TypeScope &Types) const override;
+  bool getConstantCondition(bool &Result) const override;
 };
 
 /// CallExprAST - Expression class for function calls.
@@ -201,11 +382,24 @@ class CallExprAST : public ExprAST {
   std::vector<std::unique_ptr<ExprAST>> Args;
 
 public:
-  CallExprAST(const std::string &Callee,
+  CallExprAST(SourceLocation Loc, const std::string &Callee,
               std::vector<std::unique_ptr<ExprAST>> Args)
-      : Callee(Callee), Args(std::move(Args)) {}
+      : ExprAST(Loc), Callee(Callee), Args(std::move(Args)) {}
 
   Value *codegen() override;
+  void appendKey(std::string &Key,
+                 std::set<std::string> &Callees) const override;
+  bool codegenReturn(Type *RetTy) override;
+  bool assigns(const std::string &Name) const override {
+    for (auto &Arg : Args)
+      if (Arg->assigns(Name))
+        return true;
+    return false;
+  }
+  std::unique_ptr<ExprAST> simplify(TypeScope &Types) override;
+  ValueType getType(const TypeScope &Types) const override {
+    return Callee == "len" && Args.size() == 1 ? type_int : type_infer;
+  }
 };
 
 /// IfExprAST - Expression class for if/then/else.
@@ -213,59 +407,107 @@ class IfExprAST : public ExprAST {
   std::unique_ptr<ExprAST> Cond, Then, Else;
 
 public:
-  IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-            std::unique_ptr<ExprAST> Else)
-      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+  IfExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Cond,
+            std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
+      : ExprAST(Loc), Cond(std::move(Cond)), Then(std::move(Then)),
+        Else(std::move(Else)) {}
 
   Value *codegen() override;
+  void appendKey(std::string &Key,
+                 std::set<std::string> &Callees) const override;
+  bool codegenReturn(Type *RetTy) override;
+  bool assigns(const std::string &Name) const override {
+    return Cond->assigns(Name) || Then->assigns(Name) || Else->assigns(Name);
+  }
+  std::unique_ptr<ExprAST> simplify(TypeScope &Types) override;
+  ValueType getType(const TypeScope &Types) const override;
+};
+
+/// LoopHints - Optimization hints for a loop, written as
+/// "for [vectorize=4, unroll] ...".  A count of 0 leaves the choice to LLVM.
+struct LoopHints {
+  bool Vectorize = false;
+  unsigned VectorizeWidth = 0;
+  bool Unroll = false;
+  unsigned UnrollCount = 0;
 };
 
 /// ForExprAST - Expression class for for/in.
 class ForExprAST : public ExprAST {
   std::string VarName;
+  ValueType VarType;
   std::unique_ptr<ExprAST> Start, End, Step, Body;
+  LoopHints Hints;
 
 public:
-  ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
+  ForExprAST(SourceLocation Loc, const std::string &VarName,
+             ValueType VarType, std::unique_ptr<ExprAST> Start,
              std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body)
-      : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-        Step(std::move(Step)), Body(std::move(Body)) {}
+             std::unique_ptr<ExprAST> Body, LoopHints Hints)
+      : ExprAST(Loc), VarName(VarName), VarType(VarType),
+        Start(std::move(Start)),
+        End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)),
+        Hints(Hints) {}
 
   Value *codegen() override;
+  void appendKey(std::string &Key,
+                 std::set<std::string> &Callees) const override;
+  bool assigns(const std::string &Name) const override;
+  std::unique_ptr<ExprAST> simplify(TypeScope &Types) override;
 };
 
 /// VarExprAST - Expression class for var/in
 class VarExprAST : public ExprAST {
   std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  std::vector<ValueType> VarTypes;
   std::unique_ptr<ExprAST> Body;
 
 public:
   VarExprAST(
+      SourceLocation Loc,
       std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-      std::unique_ptr<ExprAST> Body)
-      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+      std::vector<ValueType> VarTypes, std::unique_ptr<ExprAST> Body)
+      : ExprAST(Loc), VarNames(std::move(VarNames)),
+        VarTypes(std::move(VarTypes)), Body(std::move(Body)) {}
 
   Value *codegen() override;
+  void appendKey(std::string &Key,
+                 std::set<std::string> &Callees) const override;
+  bool assigns(const std::string &Name) const override;
+  std::unique_ptr<ExprAST> simplify(TypeScope &Types) override;
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes), as well as if it is an operator.
+/// of arguments the function takes), as well as if it is an operator.  The
+/// argument and return types default to double.
 class PrototypeAST {
   std::string Name;
   std::vector<std::string> Args;
+  std::vector<ValueType> ArgTypes;
+  ValueType RetType;
   bool IsOperator;
   unsigned Precedence; // Precedence if a binary op.
+  bool FastMath = false;
+  int Line;
 
 public:
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args,
-               bool IsOperator = false, unsigned Prec = 0)
-      : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-        Precedence(Prec) {}
+  PrototypeAST(SourceLocation Loc, const std::string &Name,
+               std::vector<std::string> Args, bool IsOperator = false,
+               unsigned Prec = 0, std::vector<ValueType> ArgTypes = {},
+               ValueType RetType = type_double)
+      : Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)),
+        RetType(RetType), IsOperator(IsOperator), Precedence(Prec),
+        Line(Loc.Line) {
+    this->ArgTypes.resize(this->Args.size(), type_double);
+  }
 
   Function *codegen();
+  void appendKey(std::string &Key) const;
   const std::string &getName() const { return Name; }
+  const std::vector<std::string> &getArgs() const { return Args; }
+  const std::vector<ValueType> &getArgTypes() const { return ArgTypes; }
+  ValueType getReturnType() const { return RetType; }
 
   bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
   bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
@@ -276,6 +518,10 @@ public:
   }
 
   unsigned getBinaryPrecedence() const { return Precedence; }
+
+  bool isFastMath() const { return FastMath; }
+  void setFastMath() { FastMath = true; }
+  int getLine() const { return Line; }
 };
 
 /// FunctionAST - This class represents a function definition itself.
@@ -289,6 +535,9 @@ public:
       : Proto(std::move(Proto)), Body(std::move(Body)) {}
 
   Function *codegen();
+  void simplify();
+  void appendKey(std::string &Key, std::set<std::string> &Callees) const;
+  const std::string &getName() const { return Proto->getName(); }
 };
 
 } // end anonymous namespace
@@ -319,9 +568,29 @@ static int GetTokPrecedence() {
   return TokPrec;
 }
 
+/// ErrorLog - Where LogError reports errors, or null for standard error.
+static std::string *ErrorLog = nullptr;
+
+/// EchoStream - Where the REPL prints its prompts, the IR of each item and
+/// errors, or null for standard error.  --pipeline keeps them to print with
+/// the results of the next item.
+static raw_ostream *EchoStream = nullptr;
+
+static raw_ostream &echo() { return EchoStream ? *EchoStream : errs(); }
+
+/// prompt - Ask for the next item.  The prompt goes straight to standard error
+/// even with --pipeline, so that a session at a terminal shows it while it
+/// waits for input.
+static void prompt() { errs() << "ready> "; }
+
 /// LogError* - These are little helper functions for error handling.
 std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
+  if (ErrorLog) {
+    *ErrorLog += "Error: ";
+    *ErrorLog += Str;
+    *ErrorLog += '\n';
+  } else
+    echo() << "Error: " << Str << "\n";
   return nullptr;
 }
 
@@ -332,6 +601,69 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
 
 static std::unique_ptr<ExprAST> ParseExpression();
 
+/// typeannotation ::= (':' ('double' | 'int' | 'bool'))?
+/// Leaves Ty untouched if there is no annotation, and returns false after
+/// reporting an error if the annotation is malformed.
+static bool ParseOptionalType(ValueType &Ty) {
+  if (CurTok != ':')
+    return true;
+  getNextToken(); // eat ':'.
+
+  if (CurTok == tok_identifier && IdentifierStr == "double")
+    Ty = type_double;
+  else if (CurTok == tok_identifier && IdentifierStr == "int")
+    Ty = type_int;
+  else if (CurTok == tok_identifier && IdentifierStr == "bool")
+    Ty = type_bool;
+  else if (CurTok == tok_identifier && IdentifierStr == "array")
+    Ty = type_array;
+  else {
+    LogError("expected 'double', 'int', 'bool' or 'array' after ':'");
+    return false;
+  }
+  getNextToken(); // eat the type name.
+  return true;
+}
+
+/// attributes ::= ('[' attribute (',' attribute)* ']')?
+/// attribute  ::= identifier ('=' number)?
+/// Fills Attrs with each name and its number, or 0 if there is none.  Returns
+/// false after reporting an error if the list is malformed.
+static bool ParseOptionalAttributes(std::map<std::string, unsigned> &Attrs) {
+  if (CurTok != '[')
+    return true;
+
+  do {
+    getNextToken(); // eat '[' or ','.
+    if (CurTok != tok_identifier) {
+      LogError("expected attribute name");
+      return false;
+    }
+    std::string Name = IdentifierStr;
+    getNextToken(); // eat identifier.
+
+    unsigned Val = 0;
+    if (CurTok == '=') {
+      getNextToken(); // eat '='.
+      if (CurTok != tok_number || NumVal < 1 || NumVal > 1024 ||
+          NumVal != std::trunc(NumVal)) {
+        LogError("attribute value must be an integer in 1..1024");
+        return false;
+      }
+      Val = (unsigned)NumVal;
+      getNextToken(); // eat number.
+    }
+    Attrs[Name] = Val;
+  } while (CurTok == ',');
+
+  if (CurTok != ']') {
+    LogError("expected ']' after attributes");
+    return false;
+  }
+  getNextToken(); // eat ']'.
+  return true;
+}
+
 /// numberexpr ::= number
 static std::unique_ptr<ExprAST> ParseNumberExpr() {
   auto Result = llvm::make_unique<NumberExprAST>(NumVal);
@@ -354,14 +686,28 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 
 /// identifierexpr
 ///   ::= identifier
+///   ::= identifier '[' expression ']'
 ///   ::= identifier '(' expression* ')'
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   std::string IdName = IdentifierStr;
 
+  SourceLocation LitLoc = CurLoc;
+
   getNextToken(); // eat identifier.
 
+  if (CurTok == '[') { // Array element.
+    getNextToken(); // eat [
+    auto Index = ParseExpression();
+    if (!Index)
+      return nullptr;
+    if (CurTok != ']')
+      return LogError("expected ']'");
+    getNextToken(); // eat ]
+    return llvm::make_unique<IndexExprAST>(LitLoc, IdName, std::move(Index));
+  }
+
   if (CurTok != '(') // Simple variable ref.
-    return llvm::make_unique<VariableExprAST>(IdName);
+    return llvm::make_unique<VariableExprAST>(LitLoc, IdName);
 
   // Call.
   getNextToken(); // eat (
@@ -385,11 +731,13 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   // Eat the ')'.
   getNextToken();
 
-  return llvm::make_unique<CallExprAST>(IdName, std::move(Args));
+  return llvm::make_unique<CallExprAST>(LitLoc, IdName, std::move(Args));
 }
 
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
 static std::unique_ptr<ExprAST> ParseIfExpr() {
+  SourceLocation IfLoc = CurLoc;
+
   getNextToken(); // eat the if.
 
   // condition.
@@ -414,20 +762,42 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
   if (!Else)
     return nullptr;
 
-  return llvm::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
+  return llvm::make_unique<IfExprAST>(IfLoc, std::move(Cond), std::move(Then),
                                       std::move(Else));
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+/// forexpr ::= 'for' attributes identifier typeannotation '=' expr ',' expr
+///              (',' expr)? 'in' expression
 static std::unique_ptr<ExprAST> ParseForExpr() {
+  SourceLocation ForLoc = CurLoc;
+
   getNextToken(); // eat the for.
 
+  std::map<std::string, unsigned> Attrs;
+  if (!ParseOptionalAttributes(Attrs))
+    return nullptr;
+  LoopHints Hints;
+  for (auto &Attr : Attrs) {
+    if (Attr.first == "vectorize") {
+      Hints.Vectorize = true;
+      Hints.VectorizeWidth = Attr.second;
+    } else if (Attr.first == "unroll") {
+      Hints.Unroll = true;
+      Hints.UnrollCount = Attr.second;
+    } else
+      return LogError("unknown loop attribute, expected vectorize or unroll");
+  }
+
   if (CurTok != tok_identifier)
     return LogError("expected identifier after for");
 
   std::string IdName = IdentifierStr;
   getNextToken(); // eat identifier.
 
+  ValueType IdType = type_infer;
+  if (!ParseOptionalType(IdType))
+    return nullptr;
+
   if (CurTok != '=')
     return LogError("expected '=' after for");
   getNextToken(); // eat '='.
@@ -460,16 +830,21 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
   if (!Body)
     return nullptr;
 
-  return llvm::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
-                                       std::move(Step), std::move(Body));
+  return llvm::make_unique<ForExprAST>(ForLoc, IdName, IdType,
+                                       std::move(Start), std::move(End),
+                                       std::move(Step), std::move(Body), Hints);
 }
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
+/// varexpr ::= 'var' identifier typeannotation ('=' expression)?
+//                    (',' identifier typeannotation ('=' expression)?)*
+//                    'in' expression
 static std::unique_ptr<ExprAST> ParseVarExpr() {
+  SourceLocation VarLoc = CurLoc;
+
   getNextToken(); // eat the var.
 
   std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  std::vector<ValueType> VarTypes;
 
   // At least one variable name is required.
   if (CurTok != tok_identifier)
@@ -479,6 +854,10 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
     std::string Name = IdentifierStr;
     getNextToken(); // eat identifier.
 
+    ValueType Ty = type_infer;
+    if (!ParseOptionalType(Ty))
+      return nullptr;
+
     // Read the optional initializer.
     std::unique_ptr<ExprAST> Init = nullptr;
     if (CurTok == '=') {
@@ -490,6 +869,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
     }
 
     VarNames.push_back(std::make_pair(Name, std::move(Init)));
+    VarTypes.push_back(Ty);
 
     // End of var list, exit loop.
     if (CurTok != ',')
@@ -509,7 +889,8 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
   if (!Body)
     return nullptr;
 
-  return llvm::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+  return llvm::make_unique<VarExprAST>(VarLoc, std::move(VarNames),
+                                       std::move(VarTypes), std::move(Body));
 }
 
 /// primary
@@ -547,10 +928,11 @@ static std::unique_ptr<ExprAST> ParseUnary() {
     return ParsePrimary();
 
   // If this is a unary operator, read it.
+  SourceLocation OpLoc = CurLoc;
   int Opc = CurTok;
   getNextToken();
   if (auto Operand = ParseUnary())
-    return llvm::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+    return llvm::make_unique<UnaryExprAST>(OpLoc, Opc, std::move(Operand));
   return nullptr;
 }
 
@@ -569,6 +951,7 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
 
     // Okay, we know this is a binop.
     int BinOp = CurTok;
+    SourceLocation BinLoc = CurLoc;
     getNextToken(); // eat binop
 
     // Parse the unary expression after the binary operator.
@@ -586,8 +969,8 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
     }
 
     // Merge LHS/RHS.
-    LHS =
-        llvm::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    LHS = llvm::make_unique<BinaryExprAST>(BinLoc, BinOp, std::move(LHS),
+                                           std::move(RHS));
   }
 }
 
@@ -603,12 +986,14 @@ static std::unique_ptr<ExprAST> ParseExpression() {
 }
 
 /// prototype
-///   ::= id '(' id* ')'
-///   ::= binary LETTER number? (id, id)
-///   ::= unary LETTER (id)
+///   ::= id '(' (id typeannotation)* ')' typeannotation
+///   ::= binary LETTER number? (id, id) typeannotation
+///   ::= unary LETTER (id) typeannotation
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
   std::string FnName;
 
+  SourceLocation FnLoc = CurLoc;
+
   unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
   unsigned BinaryPrecedence = 30;
 
@@ -652,28 +1037,60 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     return LogErrorP("Expected '(' in prototype");
 
   std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
+  std::vector<ValueType> ArgTypes;
+  getNextToken(); // eat '('.
+  while (CurTok == tok_identifier) {
     ArgNames.push_back(IdentifierStr);
+    getNextToken(); // eat identifier.
+
+    ValueType Ty = type_double;
+    if (!ParseOptionalType(Ty))
+      return nullptr;
+    ArgTypes.push_back(Ty);
+  }
   if (CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
 
   // success.
   getNextToken(); // eat ')'.
 
+  ValueType RetType = type_double;
+  if (!ParseOptionalType(RetType))
+    return nullptr;
+
   // Verify right number of names for operator.
   if (Kind && ArgNames.size() != Kind)
     return LogErrorP("Invalid number of operands for operator");
 
-  return llvm::make_unique<PrototypeAST>(FnName, ArgNames, Kind != 0,
-                                         BinaryPrecedence);
+  // Arrays are passed as a pointer and a length, which only works for calls.
+  if (RetType == type_array)
+    return LogErrorP("Functions cannot return arrays");
+  if (Kind && std::count(ArgTypes.begin(), ArgTypes.end(), type_array))
+    return LogErrorP("Operators cannot take arrays");
+
+  return llvm::make_unique<PrototypeAST>(FnLoc, FnName, ArgNames, Kind != 0,
+                                         BinaryPrecedence, std::move(ArgTypes),
+                                         RetType);
 }
 
-/// definition ::= 'def' prototype expression
+/// definition ::= 'def' attributes prototype expression
 static std::unique_ptr<FunctionAST> ParseDefinition() {
   getNextToken(); // eat def.
+
+  std::map<std::string, unsigned> Attrs;
+  if (!ParseOptionalAttributes(Attrs))
+    return nullptr;
+  for (auto &Attr : Attrs)
+    if (Attr.first != "fastmath" || Attr.second) {
+      LogError("unknown function attribute, expected fastmath");
+      return nullptr;
+    }
+
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
+  if (Attrs.count("fastmath"))
+    Proto->setFastMath();
 
   if (auto E = ParseExpression())
     return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
@@ -682,9 +1099,10 @@ static std::unique_ptr<FunctionAST> ParseDefinition() {
 
 /// toplevelexpr ::= expression
 static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+  SourceLocation FnLoc = CurLoc;
   if (auto E = ParseExpression()) {
     // Make an anonymous proto.
-    auto Proto = llvm::make_unique<PrototypeAST>("__anon_expr",
+    auto Proto = llvm::make_unique<PrototypeAST>(FnLoc, "__anon_expr",
                                                  std::vector<std::string>());
     return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
   }
@@ -698,286 +1116,1792 @@ static std::unique_ptr<PrototypeAST> ParseExtern() {
 }
 
 //===----------------------------------------------------------------------===//
-// Code Generation
+// AST Simplification
 //===----------------------------------------------------------------------===//
 
-static LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
-static std::unique_ptr<Module> TheModule;
-static std::map<std::string, AllocaInst *> NamedValues;
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+static cl::opt<bool>
+    SimplifyAST("simplify-ast",
+                cl::desc("Fold constants and dead 'if' arms before codegen"),
+                cl::init(true));
+
+// Off by default: the arithmetic on an int variable wraps instead of rounding,
+// which would change what existing scripts compute.
+static cl::opt<bool>
+    InferInt("infer-int",
+             cl::desc("Count unannotated for loops in int when the start "
+                      "value and the step are integers"));
+
+/// simplifyExpr - Simplify E, replacing it if it folds to something simpler.
+static void simplifyExpr(std::unique_ptr<ExprAST> &E, TypeScope &Types) {
+  if (auto New = E->simplify(Types))
+    E = std::move(New);
+}
 
-Value *LogErrorV(const char *Str) {
-  LogError(Str);
-  return nullptr;
+/// isNumeric - Return true if E is known to be an int or a double.  Dropping
+/// an operation on E such as "E*1" would not change its type then, while a
+/// bool would have been promoted to int.
+static bool isNumeric(const ExprAST &E, const TypeScope &Types) {
+  ValueType Ty = E.getType(Types);
+  return Ty == type_int || Ty == type_double;
 }
 
-Function *getFunction(std::string Name) {
-  // First, see if the function has already been added to the current module.
-  if (auto *F = TheModule->getFunction(Name))
-    return F;
+bool NumberExprAST::getConstantCondition(bool &Result) const {
+  // The same test as converting to bool, so NaN is false.
+  Result = Val < 0 || Val > 0;
+  return true;
+}
 
-  // If not, check whether we can codegen the declaration from some existing
-  // prototype.
-  auto FI = FunctionProtos.find(Name);
-  if (FI != FunctionProtos.end())
-    return FI->second->codegen();
+ValueType VariableExprAST::getType(const TypeScope &Types) const {
+  auto I = Types.find(Name);
+  return I == Types.end() ? type_infer : I->second;
+}
 
-  // If no existing prototype exists, return null.
+std::unique_ptr<ExprAST> IndexExprAST::simplify(TypeScope &Types) {
+  simplifyExpr(Index, Types);
   return nullptr;
 }
 
-/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
-/// the function.  This is used for mutable variables etc.
-static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                          const std::string &VarName) {
-  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
-                   TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(TheContext), nullptr, VarName);
+std::unique_ptr<ExprAST> UnaryExprAST::simplify(TypeScope &Types) {
+  simplifyExpr(Operand, Types);
+  return nullptr;
 }
 
-Value *NumberExprAST::codegen() {
-  return ConstantFP::get(TheContext, APFloat(Val));
+std::unique_ptr<ExprAST> BinaryExprAST::simplify(TypeScope &Types) {
+  simplifyExpr(LHS, Types);
+  simplifyExpr(RHS, Types);
+  if (Op != '+' && Op != '-' && Op != '*')
+    return nullptr;
+
+  // Arithmetic on two literals is always done in double, so fold it the way
+  // IRBuilder would have folded the instruction.
+  double L, R;
+  bool LConst = LHS->getConstant(L);
+  bool RConst = RHS->getConstant(R);
+  if (LConst && RConst)
+    return llvm::make_unique<NumberExprAST>(
+        Op == '+' ? L + R : Op == '-' ? L - R : L * R, Loc);
+
+  // Only remove operations that give back the other operand for every int and
+  // every IEEE double, NaN and -0.0 included: x*1, 1*x, x-0.0 and x+-0.0.
+  // x+0.0 is +0.0 for x = -0.0, so x+0 is only removed for an int.
+  if (Op == '*' && RConst && R == 1 && isNumeric(*LHS, Types))
+    return std::move(LHS);
+  if (Op == '*' && LConst && L == 1 && isNumeric(*RHS, Types))
+    return std::move(RHS);
+  if (Op == '-' && RConst && R == 0 && !std::signbit(R) &&
+      isNumeric(*LHS, Types))
+    return std::move(LHS);
+  if (Op == '+' && RConst && R == 0 &&
+      (std::signbit(R) ? isNumeric(*LHS, Types)
+                       : LHS->getType(Types) == type_int))
+    return std::move(LHS);
+  if (Op == '+' && LConst && L == 0 &&
+      (std::signbit(L) ? isNumeric(*RHS, Types)
+                       : RHS->getType(Types) == type_int))
+    return std::move(RHS);
+  return nullptr;
 }
 
-Value *VariableExprAST::codegen() {
-  // Look this variable up in the function.
-  Value *V = NamedValues[Name];
-  if (!V)
-    return LogErrorV("Unknown variable name");
+ValueType BinaryExprAST::getType(const TypeScope &Types) const {
+  if (Op == '<')
+    return type_bool;
+  if (Op != '+' && Op != '-' && Op != '*')
+    return type_infer;
+
+  // The same rules as getArithmeticType.
+  ValueType L = LHS->getType(Types);
+  ValueType R = RHS->getType(Types);
+  if (L == type_infer || L == type_array || R == type_infer ||
+      R == type_array)
+    return type_infer;
+  bool LIsInt = L != type_double || LHS->isIntegralConstant();
+  bool RIsInt = R != type_double || RHS->isIntegralConstant();
+  if (LIsInt && RIsInt && (L != type_double || R != type_double))
+    return type_int;
+  return type_double;
+}
 
-  // Load the value.
-  return Builder.CreateLoad(V, Name.c_str());
+bool BinaryExprAST::getConstantCondition(bool &Result) const {
+  double L, R;
+  if (Op != '<' || !LHS->getConstant(L) || !RHS->getConstant(R))
+    return false;
+  // An unordered less than, like the fcmp it replaces.
+  Result = !(L >= R);
+  return true;
 }
 
-Value *UnaryExprAST::codegen() {
-  Value *OperandV = Operand->codegen();
-  if (!OperandV)
+std::unique_ptr<ExprAST> CallExprAST::simplify(TypeScope &Types) {
+  for (auto &Arg : Args)
+    simplifyExpr(Arg, Types);
+  return nullptr;
+}
+
+std::unique_ptr<ExprAST> IfExprAST::simplify(TypeScope &Types) {
+  simplifyExpr(Cond, Types);
+  simplifyExpr(Then, Types);
+  simplifyExpr(Else, Types);
+
+  bool CondVal;
+  if (!Cond->getConstantCondition(CondVal))
     return nullptr;
 
-  Function *F = getFunction(std::string("unary") + Opcode);
-  if (!F)
-    return LogErrorV("Unknown unary operator");
+  // Arms of different types are converted to a common type, so the arm that
+  // is taken can only replace the 'if' when both have the same type.
+  ValueType Ty = Then->getType(Types);
+  if (Ty == type_infer || Ty != Else->getType(Types))
+    return nullptr;
+  return CondVal ? std::move(Then) : std::move(Else);
+}
 
-  return Builder.CreateCall(F, OperandV, "unop");
+ValueType IfExprAST::getType(const TypeScope &Types) const {
+  ValueType Ty = Then->getType(Types);
+  return Ty == Else->getType(Types) ? Ty : type_infer;
 }
 
-Value *BinaryExprAST::codegen() {
-  // Special case '=' because we don't want to emit the LHS as an expression.
-  if (Op == '=') {
-    // Assignment requires the LHS to be an identifier.
-    // This assume we're building without RTTI because LLVM builds that way by
-    // default.  If you build LLVM with RTTI this can be changed to a
-    // dynamic_cast for automatic error checking.
-    VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
-    if (!LHSE)
-      return LogErrorV("destination of '=' must be a variable");
-    // Codegen the RHS.
-    Value *Val = RHS->codegen();
-    if (!Val)
-      return nullptr;
+std::unique_ptr<ExprAST> ForExprAST::simplify(TypeScope &Types) {
+  simplifyExpr(Start, Types);
+
+  // Infer the type of the variable as codegen does.  Simplifying the rest of
+  // the loop can only turn a double variable into an int, which is fine for
+  // everything that depends on it here.
+  ValueType Ty = VarType;
+  if (Ty == type_infer && !InferInt)
+    Ty = type_double;
+  if (Ty == type_infer) {
+    ValueType StartTy = Start->getType(Types);
+    bool IntStart = StartTy == type_int || Start->isIntegralConstant();
+    bool IntStep = !Step || Step->isIntegralConstant();
+    bool Assigned = End->assigns(VarName) ||
+                    (Step && Step->assigns(VarName)) || Body->assigns(VarName);
+    if (IntStart && IntStep && !Assigned)
+      Ty = type_int;
+    else if (StartTy != type_infer || !IntStep || Assigned)
+      Ty = type_double;
+  }
 
-    // Look up the name.
-    Value *Variable = NamedValues[LHSE->getName()];
-    if (!Variable)
-      return LogErrorV("Unknown variable name");
+  ValueType OldTy = Types[VarName];
+  Types[VarName] = Ty;
+  simplifyExpr(End, Types);
+  if (Step)
+    simplifyExpr(Step, Types);
+  simplifyExpr(Body, Types);
+  Types[VarName] = OldTy;
+  return nullptr;
+}
 
-    Builder.CreateStore(Val, Variable);
-    return Val;
-  }
+std::unique_ptr<ExprAST> VarExprAST::simplify(TypeScope &Types) {
+  std::vector<ValueType> OldTypes;
 
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
-  if (!L || !R)
-    return nullptr;
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    const std::string &VarName = VarNames[i].first;
+    auto &Init = VarNames[i].second;
 
-  switch (Op) {
-  case '+':
-    return Builder.CreateFAdd(L, R, "addtmp");
-  case '-':
-    return Builder.CreateFSub(L, R, "subtmp");
-  case '*':
-    return Builder.CreateFMul(L, R, "multmp");
-  case '<':
-    L = Builder.CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder.CreateUIToFP(L, Type::getDoubleTy(TheContext), "booltmp");
-  default:
-    break;
+    // Infer the type of the variable as codegen does.
+    ValueType Ty = VarTypes[i];
+    if (Init) {
+      simplifyExpr(Init, Types);
+      ValueType InitTy = Init->getType(Types);
+      if (Ty == type_infer && InitTy == type_int) {
+        bool Assigned = Body->assigns(VarName);
+        for (unsigned j = i + 1; j != e && !Assigned; ++j)
+          Assigned = VarNames[j].second && VarNames[j].second->assigns(VarName);
+        Ty = Assigned ? type_double : type_int;
+      } else if (Ty == type_infer && InitTy != type_infer)
+        Ty = InitTy == type_array ? type_array : type_double;
+    } else if (Ty == type_infer)
+      Ty = type_double;
+
+    OldTypes.push_back(Types[VarName]);
+    Types[VarName] = Ty;
   }
 
-  // If it wasn't a builtin binary operator, it must be a user defined one. Emit
-  // a call to it.
-  Function *F = getFunction(std::string("binary") + Op);
-  assert(F && "binary operator not found!");
+  simplifyExpr(Body, Types);
 
-  Value *Ops[] = {L, R};
-  return Builder.CreateCall(F, Ops, "binop");
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
+    Types[VarNames[i].first] = OldTypes[i];
+  return nullptr;
 }
 
-Value *CallExprAST::codegen() {
-  // Look up the name in the global module table.
-  Function *CalleeF = getFunction(Callee);
-  if (!CalleeF)
-    return LogErrorV("Unknown function referenced");
+void FunctionAST::simplify() {
+  TypeScope Types;
+  for (unsigned i = 0, e = Proto->getArgs().size(); i != e; ++i)
+    Types[Proto->getArgs()[i]] = Proto->getArgTypes()[i];
+  simplifyExpr(Body, Types);
+}
 
-  // If argument mismatch error.
-  if (CalleeF->arg_size() != Args.size())
-    return LogErrorV("Incorrect # arguments passed");
+//===----------------------------------------------------------------------===//
+// AST keys
+//===----------------------------------------------------------------------===//
 
-  std::vector<Value *> ArgsV;
-  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen());
-    if (!ArgsV.back())
-      return nullptr;
-  }
+/// appendKeyName - Append Name to Key, ended by a character that no name has.
+static void appendKeyName(std::string &Key, const std::string &Name) {
+  Key += Name;
+  Key += ';';
+}
 
-  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+/// appendKeyType - Append the letter of Ty to Key.
+static void appendKeyType(std::string &Key, ValueType Ty) {
+  Key += "?dibA"[Ty];
 }
 
-Value *IfExprAST::codegen() {
-  Value *CondV = Cond->codegen();
-  if (!CondV)
-    return nullptr;
+void NumberExprAST::appendKey(std::string &Key,
+                              std::set<std::string> &Callees) const {
+  // Every bit of the value, so that literals that print the same still differ.
+  char Buf[32];
+  snprintf(Buf, sizeof(Buf), "n%a;", Val);
+  Key += Buf;
+}
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  CondV = Builder.CreateFCmpONE(
-      CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
+void VariableExprAST::appendKey(std::string &Key,
+                                std::set<std::string> &Callees) const {
+  Key += 'v';
+  appendKeyName(Key, Name);
+}
 
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+void IndexExprAST::appendKey(std::string &Key,
+                             std::set<std::string> &Callees) const {
+  Key += '[';
+  appendKeyName(Key, Name);
+  Index->appendKey(Key, Callees);
+}
 
-  // Create blocks for the then and else cases.  Insert the 'then' block at the
-  // end of the function.
-  BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-  BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else");
-  BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
+void UnaryExprAST::appendKey(std::string &Key,
+                             std::set<std::string> &Callees) const {
+  Key += 'u';
+  Key += Opcode;
+  Callees.insert(std::string("unary") + Opcode);
+  Operand->appendKey(Key, Callees);
+}
 
-  Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+void BinaryExprAST::appendKey(std::string &Key,
+                              std::set<std::string> &Callees) const {
+  Key += 'b';
+  Key += Op;
+  Callees.insert(std::string("binary") + Op);
+  LHS->appendKey(Key, Callees);
+  RHS->appendKey(Key, Callees);
+}
 
-  // Emit then value.
-  Builder.SetInsertPoint(ThenBB);
+void CallExprAST::appendKey(std::string &Key,
+                            std::set<std::string> &Callees) const {
+  Key += 'c';
+  appendKeyName(Key, Callee);
+  appendKeyName(Key, std::to_string(Args.size()));
+  Callees.insert(Callee);
+  for (const auto &Arg : Args)
+    Arg->appendKey(Key, Callees);
+}
 
-  Value *ThenV = Then->codegen();
-  if (!ThenV)
-    return nullptr;
+void IfExprAST::appendKey(std::string &Key,
+                          std::set<std::string> &Callees) const {
+  Key += 'i';
+  Cond->appendKey(Key, Callees);
+  Then->appendKey(Key, Callees);
+  Else->appendKey(Key, Callees);
+}
 
-  Builder.CreateBr(MergeBB);
-  // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-  ThenBB = Builder.GetInsertBlock();
+void ForExprAST::appendKey(std::string &Key,
+                           std::set<std::string> &Callees) const {
+  Key += 'f';
+  appendKeyName(Key, VarName);
+  appendKeyType(Key, VarType);
+  char Buf[64];
+  snprintf(Buf, sizeof(Buf), "%d,%u,%d,%u;", Hints.Vectorize,
+           Hints.VectorizeWidth, Hints.Unroll, Hints.UnrollCount);
+  Key += Buf;
+  Start->appendKey(Key, Callees);
+  End->appendKey(Key, Callees);
+  if (Step)
+    Step->appendKey(Key, Callees);
+  else
+    Key += '-';
+  Body->appendKey(Key, Callees);
+}
 
-  // Emit else block.
-  TheFunction->getBasicBlockList().push_back(ElseBB);
-  Builder.SetInsertPoint(ElseBB);
+void VarExprAST::appendKey(std::string &Key,
+                           std::set<std::string> &Callees) const {
+  Key += 'V';
+  appendKeyName(Key, std::to_string(VarNames.size()));
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    appendKeyName(Key, VarNames[i].first);
+    appendKeyType(Key, VarTypes[i]);
+    if (VarNames[i].second)
+      VarNames[i].second->appendKey(Key, Callees);
+    else
+      Key += '-';
+  }
+  Body->appendKey(Key, Callees);
+}
 
-  Value *ElseV = Else->codegen();
-  if (!ElseV)
-    return nullptr;
+void PrototypeAST::appendKey(std::string &Key) const {
+  Key += 'p';
+  appendKeyName(Key, Name);
+  appendKeyName(Key, std::to_string(Args.size()));
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    appendKeyName(Key, Args[i]);
+    appendKeyType(Key, ArgTypes[i]);
+  }
+  appendKeyType(Key, RetType);
+  appendKeyName(Key, std::to_string(IsOperator ? Precedence : 0));
+  Key += FastMath ? 'F' : '-';
+}
 
-  Builder.CreateBr(MergeBB);
-  // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
-  ElseBB = Builder.GetInsertBlock();
+void FunctionAST::appendKey(std::string &Key,
+                            std::set<std::string> &Callees) const {
+  Proto->appendKey(Key);
+  Body->appendKey(Key, Callees);
+}
 
-  // Emit merge block.
-  TheFunction->getBasicBlockList().push_back(MergeBB);
-  Builder.SetInsertPoint(MergeBB);
-  PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "iftmp");
+//===----------------------------------------------------------------------===//
+// Phase timing
+//===----------------------------------------------------------------------===//
 
-  PN->addIncoming(ThenV, ThenBB);
-  PN->addIncoming(ElseV, ElseBB);
-  return PN;
-}
+static cl::opt<bool> TimePhases(
+    "time-phases",
+    cl::desc("Print the time spent in each phase of handling every "
+             "definition and expression as JSON lines"));
 
-// Output for-loop as:
-//   var = alloca double
-//   ...
-//   start = startexpr
-//   store start -> var
-//   goto loop
-// loop:
-//   ...
-//   bodyexpr
-//   ...
-// loopend:
-//   step = stepexpr
-//   endcond = endexpr
-//
-//   curvar = load var
-//   nextvar = curvar + step
-//   store nextvar -> var
-//   br endcond, loop, endloop
-// outloop:
-Value *ForExprAST::codegen() {
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+static cl::opt<std::string>
+    TimePhasesFile("time-phases-file",
+                   cl::desc("Write the --time-phases output to this file "
+                            "instead of stderr"),
+                   cl::value_desc("filename"));
 
-  // Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+namespace {
 
-  // Emit the start code first, without 'variable' in scope.
-  Value *StartVal = Start->codegen();
-  if (!StartVal)
-    return nullptr;
+/// Phase - The phases of handling a definition, extern or expression.  Parsing
+/// includes reading the input, so it also counts the time spent waiting for a
+/// line at an interactive prompt.
+enum Phase {
+  phase_parse,
+  phase_simplify,
+  phase_codegen,
+  phase_optimize,
+  phase_jit,
+  phase_lookup,
+  phase_execute,
+  num_phases
+};
 
-  // Store the value into the alloca.
-  Builder.CreateStore(StartVal, Alloca);
+const char *PhaseNames[num_phases] = {"parse",  "simplify", "codegen",
+                                      "optimize", "jit",    "lookup",
+                                      "execute"};
 
-  // Make the new basic block for the loop header, inserting after current
-  // block.
-  BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+/// PhaseTimer - Add the time from construction to destruction to a phase of
+/// the current item.  The time of a PhaseTimer nested inside another one is
+/// only counted in the inner phase, so that optimizing a function is not also
+/// counted as generating code for it.
+class PhaseTimer {
+  Phase P;
+  PhaseTimer *Parent;
+  std::chrono::steady_clock::time_point Start;
+  uint64_t NestedNanos = 0;
 
-  // Insert an explicit fall through from the current block to the LoopBB.
-  Builder.CreateBr(LoopBB);
+  static PhaseTimer *Current;
 
-  // Start insertion in LoopBB.
-  Builder.SetInsertPoint(LoopBB);
+public:
+  PhaseTimer(Phase P);
+  ~PhaseTimer() { stop(); }
 
-  // Within the loop, the variable is defined equal to the PHI node.  If it
-  // shadows an existing variable, we have to restore it, so save it now.
-  AllocaInst *OldVal = NamedValues[VarName];
-  NamedValues[VarName] = Alloca;
+  /// stop - Stop the timer before it is destroyed.
+  void stop();
+};
 
-  // Emit the body of the loop.  This, like any other expr, can change the
-  // current BB.  Note that we ignore the value computed by the body, but don't
-  // allow an error.
-  if (!Body->codegen())
-    return nullptr;
+} // end anonymous namespace
 
-  // Emit the step value.
-  Value *StepVal = nullptr;
-  if (Step) {
+PhaseTimer *PhaseTimer::Current = nullptr;
+
+/// ItemNanos/ItemRan - The time spent in each phase of the current item, and
+/// whether it got that far.
+static uint64_t ItemNanos[num_phases];
+static bool ItemRan[num_phases];
+
+/// PhaseSamples - The time of each phase for every item so far, for the
+/// summary.
+static std::vector<uint64_t> PhaseSamples[num_phases];
+static unsigned NumItems = 0;
+
+PhaseTimer::PhaseTimer(Phase P) : P(P), Parent(Current) {
+  if (!TimePhases)
+    return;
+  Current = this;
+  Start = std::chrono::steady_clock::now();
+}
+
+void PhaseTimer::stop() {
+  if (!TimePhases || Current != this)
+    return;
+  uint64_t Nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - Start)
+                       .count();
+  ItemNanos[P] += Nanos - NestedNanos;
+  ItemRan[P] = true;
+  if (Parent)
+    Parent->NestedNanos += Nanos;
+  Current = Parent;
+}
+
+/// writeTiming - Write a line of timing output.
+static void writeTiming(const std::string &Line) {
+  static FILE *File = nullptr;
+  if (!File && !TimePhasesFile.empty()) {
+    File = fopen(TimePhasesFile.c_str(), "w");
+    if (!File) {
+      fprintf(stderr, "Error: cannot open %s\n", TimePhasesFile.c_str());
+      exit(1);
+    }
+  }
+  fprintf(File ? File : stderr, "%s\n", Line.c_str());
+  fflush(File ? File : stderr);
+}
+
+/// beginItem - Start timing a new item.
+static void beginItem() {
+  for (unsigned i = 0; i != num_phases; ++i) {
+    ItemNanos[i] = 0;
+    ItemRan[i] = false;
+  }
+}
+
+/// endItem - Print the phase times of the item that was just handled as a
+/// JSON line, such as
+///   {"item":3,"kind":"expression","name":"__anon_expr","ok":true,
+///    "ns":{"parse":5210,"codegen":18400,...},"total_ns":912345}
+static void endItem(const char *Kind, const std::string &Name, bool OK) {
+  if (!TimePhases)
+    return;
+
+  std::string Line;
+  raw_string_ostream OS(Line);
+  OS << "{\"item\":" << ++NumItems << ",\"kind\":\"" << Kind
+     << "\",\"name\":\"";
+  OS.write_escaped(Name);
+  OS << "\",\"ok\":" << (OK ? "true" : "false") << ",\"ns\":{";
+  uint64_t Total = 0;
+  const char *Sep = "";
+  for (unsigned i = 0; i != num_phases; ++i) {
+    if (!ItemRan[i])
+      continue;
+    OS << Sep << '"' << PhaseNames[i] << "\":" << ItemNanos[i];
+    Sep = ",";
+    Total += ItemNanos[i];
+    PhaseSamples[i].push_back(ItemNanos[i]);
+  }
+  OS << "},\"total_ns\":" << Total << '}';
+  writeTiming(OS.str());
+}
+
+/// printTimingSummary - Print a JSON line for each phase with the number of
+/// samples, their percentiles and a histogram with power of two buckets keyed
+/// by their lower bound in nanoseconds, then one with the time of each LLVM
+/// pass.
+static void printTimingSummary() {
+  for (unsigned i = 0; i != num_phases; ++i) {
+    std::vector<uint64_t> Samples = PhaseSamples[i];
+    if (Samples.empty())
+      continue;
+    std::sort(Samples.begin(), Samples.end());
+    auto Percentile = [&](unsigned P) {
+      return Samples[(Samples.size() * P + 99) / 100 - 1];
+    };
+    uint64_t Total = 0;
+    std::map<uint64_t, unsigned> Histogram;
+    for (uint64_t Nanos : Samples) {
+      Total += Nanos;
+      uint64_t Bucket = 1;
+      while (Bucket <= Nanos / 2)
+        Bucket *= 2;
+      ++Histogram[Nanos ? Bucket : 0];
+    }
+
+    std::string Line;
+    raw_string_ostream OS(Line);
+    OS << "{\"phase\":\"" << PhaseNames[i] << "\",\"count\":" << Samples.size()
+       << ",\"total_ns\":" << Total << ",\"p50_ns\":" << Percentile(50)
+       << ",\"p99_ns\":" << Percentile(99) << ",\"max_ns\":" << Samples.back()
+       << ",\"histogram\":{";
+    const char *Sep = "";
+    for (auto &Bucket : Histogram) {
+      OS << Sep << '"' << Bucket.first << "\":" << Bucket.second;
+      Sep = ",";
+    }
+    OS << "}}";
+    writeTiming(OS.str());
+  }
+
+  // LLVM keeps timers for the passes of every pass manager, so there is a set
+  // for each module.  Add up the wall time of each pass, which is printed on
+  // lines like '\t"time.pass.instcombine.wall": 1.5e-05,'.
+  std::string Timers;
+  raw_string_ostream TimersOS(Timers);
+  TimerGroup::printAllJSONValues(TimersOS, "");
+  TimersOS.flush();
+  std::map<std::string, double> PassSeconds;
+  StringRef Rest = Timers;
+  while (!Rest.empty()) {
+    StringRef Timer;
+    std::tie(Timer, Rest) = Rest.split('\n');
+    Timer = Timer.trim().rtrim(',');
+    if (!Timer.consume_front("\"time.pass."))
+      continue;
+    size_t NameEnd = Timer.find(".wall\": ");
+    double Seconds;
+    if (NameEnd == StringRef::npos ||
+        Timer.substr(NameEnd + 8).getAsDouble(Seconds))
+      continue;
+    PassSeconds[Timer.take_front(NameEnd).str()] += Seconds;
+  }
+
+  std::string Line;
+  raw_string_ostream OS(Line);
+  OS << "{\"passes_ns\":{";
+  const char *Sep = "";
+  for (auto &Pass : PassSeconds) {
+    OS << Sep << '"';
+    OS.write_escaped(Pass.first);
+    OS << "\":" << (uint64_t)(Pass.second * 1e9);
+    Sep = ",";
+  }
+  OS << "}}";
+  writeTiming(OS.str());
+}
+
+/// setPhaseTiming - Turn phase timing, and the timers LLVM keeps for each
+/// pass, on or off.
+static void setPhaseTiming(bool Enable) {
+  TimePhases = Enable;
+  TimePassesIsEnabled = Enable;
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation Globals
+//===----------------------------------------------------------------------===//
+
+// Not "ffast-math", which the Hexagon backend already registers.
+static cl::opt<bool>
+    FastMath("fast-math",
+             cl::desc("Allow unsafe floating point optimizations, such as "
+                      "reassociation, in every function"));
+
+static std::unique_ptr<LLVMContext> TheContext;
+static std::unique_ptr<IRBuilder<>> Builder;
+static std::unique_ptr<Module> TheModule;
+static std::map<std::string, Value *> NamedValues;
+static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+static std::unique_ptr<KaleidoscopeJIT> TheJIT;
+static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+/// DefinitionCount - How many times each function has been defined, which
+/// numbers the names of its bodies.  A function that is not in here has only
+/// been declared.
+static std::map<std::string, unsigned> DefinitionCount;
+
+/// IntrinsicCalls - The libm functions that calls have been compiled to
+/// intrinsics for, by getMathIntrinsic.  Those calls never reach a definition,
+/// so one of these names cannot be defined any more.
+static std::set<std::string> IntrinsicCalls;
+
+//===----------------------------------------------------------------------===//
+// Debug Info Support
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool>
+    EmitDebugInfo("g", cl::desc("Emit line tables and argument locations, so "
+                                "that debuggers and profilers can map JIT'd "
+                                "code back to the source"));
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input file>"),
+                                          cl::init("-"));
+
+static std::unique_ptr<DIBuilder> DBuilder;
+
+struct DebugInfo {
+  DICompileUnit *TheCU;
+  DIFile *Unit;
+  std::map<ValueType, DIType *> Types;
+  std::vector<DIScope *> LexicalBlocks;
+
+  void emitLocation(ExprAST *AST);
+  DIType *getType(ValueType Ty);
+  DISubroutineType *getFunctionType(const PrototypeAST &P);
+} KSDbgInfo;
+
+/// getType - Return the debug info type of Ty.  An array is described as the
+/// struct of a data pointer and a length that holds it.
+DIType *DebugInfo::getType(ValueType Ty) {
+  DIType *&DITy = Types[Ty];
+  if (DITy)
+    return DITy;
+
+  switch (Ty) {
+  case type_int:
+    return DITy = DBuilder->createBasicType("int", 64, dwarf::DW_ATE_signed);
+  case type_bool:
+    return DITy = DBuilder->createBasicType("bool", 8, dwarf::DW_ATE_boolean);
+  case type_array: {
+    DIType *DataTy = DBuilder->createPointerType(getType(type_double), 64);
+    Metadata *Members[] = {
+        DBuilder->createMemberType(Unit, "data", Unit, 0, 64, 64, 0,
+                                   DINode::FlagZero, DataTy),
+        DBuilder->createMemberType(Unit, "len", Unit, 0, 64, 64, 64,
+                                   DINode::FlagZero, getType(type_int))};
+    return DITy = DBuilder->createStructType(
+               Unit, "array", Unit, 0, 128, 64, DINode::FlagZero, nullptr,
+               DBuilder->getOrCreateArray(Members));
+  }
+  default:
+    return DITy = DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+  }
+}
+
+/// getFunctionType - Return the debug info type of the function P.
+DISubroutineType *DebugInfo::getFunctionType(const PrototypeAST &P) {
+  SmallVector<Metadata *, 8> EltTys;
+  EltTys.push_back(getType(P.getReturnType()));
+  for (ValueType Ty : P.getArgTypes())
+    EltTys.push_back(getType(Ty));
+  return DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(EltTys));
+}
+
+/// emitLocation - Give the instructions emitted from now on the location of
+/// AST, or no location if AST is null.
+void DebugInfo::emitLocation(ExprAST *AST) {
+  if (!DBuilder)
+    return;
+  if (!AST)
+    return Builder->SetCurrentDebugLocation(DebugLoc());
+  DIScope *Scope;
+  if (LexicalBlocks.empty())
+    Scope = TheCU;
+  else
+    Scope = LexicalBlocks.back();
+  Builder->SetCurrentDebugLocation(
+      DILocation::get(*TheContext, AST->getLine(), AST->getCol(), Scope));
+}
+
+//===----------------------------------------------------------------------===//
+// Profiling
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool>
+    Profile("profile",
+            cl::desc("Count how often each function, 'if' arm and loop runs, "
+                     "and compile hot functions again with the counts"));
+
+static cl::opt<unsigned> ProfileThreshold(
+    "profile-threshold",
+    cl::desc("With --profile, compile a function again once it has been "
+             "called this many times (0 waits for ':profile optimize')"),
+    cl::init(10000));
+
+/// CodeCounts - The counts of an 'if' or a 'for', keyed by where it starts in
+/// the input, which stays the same when the definition is compiled again.
+typedef std::map<std::pair<int, int>, std::pair<uint64_t, uint64_t>>
+    CodeCounts;
+
+/// FunctionProfile - The counters --profile compiles into a definition.  The
+/// code updates them with plain loads and stores, so with caller threads some
+/// counts get lost.
+struct FunctionProfile {
+  uint64_t Calls = 0;
+  /// Arms - How often the 'then' and the 'else' arm of each 'if' ran.
+  CodeCounts Arms;
+  /// Loops - How often each 'for' was entered, and how many iterations it ran.
+  CodeCounts Loops;
+  /// Optimized - Set once the definition runs code compiled with these counts
+  /// instead of the counters.
+  bool Optimized = false;
+  /// AST - The definition, to compile it again.
+  std::unique_ptr<FunctionAST> AST;
+};
+
+/// Profiles - The profile of each definition.  Code compiled with counters
+/// may run as long as the JIT keeps it, so a profile replaced by a new
+/// definition is kept in OldProfiles instead of being freed.
+static std::map<std::string, std::unique_ptr<FunctionProfile>> Profiles;
+static std::vector<std::unique_ptr<FunctionProfile>> OldProfiles;
+
+/// CurProfile - The profile of the definition being compiled, or null.  With
+/// ApplyProfile its counts become branch weights, otherwise the code gets
+/// counters that fill it.
+static FunctionProfile *CurProfile = nullptr;
+static bool ApplyProfile = false;
+
+/// HotProfiles - The profiles whose call count has reached --profile-threshold
+/// since optimizeHotProfiles last looked.  The code of any thread may add to
+/// it, so it has a lock.
+static std::mutex HotProfilesLock;
+static std::vector<FunctionProfile *> HotProfiles;
+
+/// profileIsHot - Called by the code of the definition of FP once it has been
+/// called --profile-threshold times.
+static void profileIsHot(FunctionProfile *FP) {
+  std::lock_guard<std::mutex> Guard(HotProfilesLock);
+  HotProfiles.push_back(FP);
+}
+
+/// emitCounter - Emit code that adds one to Counter, and return the new count.
+static Value *emitCounter(IRBuilder<> &B, uint64_t &Counter) {
+  Type *I64 = Type::getInt64Ty(*TheContext);
+  Value *Ptr = ConstantExpr::getIntToPtr(
+      ConstantInt::get(I64, reinterpret_cast<uintptr_t>(&Counter)),
+      I64->getPointerTo());
+  Value *N = B.CreateAdd(B.CreateLoad(Ptr, "count"), ConstantInt::get(I64, 1));
+  B.CreateStore(N, Ptr);
+  return N;
+}
+
+/// getBranchWeights - The weights of a branch that went to its first successor
+/// True times and to its second False times, scaled to fit in 32 bits.  Every
+/// weight is at least 1, since a branch not taken so far may still be taken.
+static MDNode *getBranchWeights(uint64_t True, uint64_t False) {
+  while (True >= UINT32_MAX || False >= UINT32_MAX) {
+    True >>= 1;
+    False >>= 1;
+  }
+  return MDBuilder(*TheContext).createBranchWeights(True + 1, False + 1);
+}
+
+/// profileFunction - Count the calls to F, whose entry block is the insertion
+/// point, or give F its call count.  A function that has never been called is
+/// cold.  The call that reaches --profile-threshold reports the profile to
+/// profileIsHot, so that the REPL does not have to look at every profile.
+static void profileFunction(Function *F) {
+  if (!CurProfile)
+    return;
+  if (!ApplyProfile) {
+    Value *Calls = emitCounter(*Builder, CurProfile->Calls);
+    if (!ProfileThreshold)
+      return;
+    BasicBlock *HotBB = BasicBlock::Create(*TheContext, "hot", F);
+    BasicBlock *BodyBB = BasicBlock::Create(*TheContext, "body", F);
+    Value *Hot = Builder->CreateICmpEQ(
+        Calls, ConstantInt::get(Calls->getType(), ProfileThreshold));
+    Builder->CreateCondBr(Hot, HotBB, BodyBB,
+                          getBranchWeights(1, ProfileThreshold));
+    Builder->SetInsertPoint(HotBB);
+    Type *I64 = Type::getInt64Ty(*TheContext);
+    Type *I8Ptr = Type::getInt8PtrTy(*TheContext);
+    FunctionType *HotTy =
+        FunctionType::get(Type::getVoidTy(*TheContext), I8Ptr, false);
+    Value *Report = ConstantExpr::getIntToPtr(
+        ConstantInt::get(I64, reinterpret_cast<uintptr_t>(&profileIsHot)),
+        HotTy->getPointerTo());
+    Value *Arg = ConstantExpr::getIntToPtr(
+        ConstantInt::get(I64, reinterpret_cast<uintptr_t>(CurProfile)), I8Ptr);
+    Builder->CreateCall(HotTy, Report, Arg);
+    Builder->CreateBr(BodyBB);
+    Builder->SetInsertPoint(BodyBB);
+    return;
+  }
+  F->setEntryCount(CurProfile->Calls);
+  if (!CurProfile->Calls)
+    F->addFnAttr(Attribute::Cold);
+}
+
+/// profileIf - Weight the branch Br of the 'if' If between its arms.
+static void profileIf(const ExprAST &If, BranchInst *Br) {
+  if (!CurProfile || !ApplyProfile)
+    return;
+  auto &Counts = CurProfile->Arms[{If.getLine(), If.getCol()}];
+  Br->setMetadata(LLVMContext::MD_prof,
+                  getBranchWeights(Counts.first, Counts.second));
+}
+
+/// profileArm - Count the runs of the 'then' (or the 'else') arm of the 'if'
+/// If, whose first block is the insertion point.
+static void profileArm(const ExprAST &If, bool Then) {
+  if (!CurProfile || ApplyProfile)
+    return;
+  auto &Counts = CurProfile->Arms[{If.getLine(), If.getCol()}];
+  emitCounter(*Builder, Then ? Counts.first : Counts.second);
+}
+
+/// profileLoop - Count the entries to the 'for' For at its preheader branch
+/// Entry and the iterations at its backedge, or weight the backedge.  Each
+/// entry runs at least one iteration, so the backedge is taken for all the
+/// iterations but the last of each entry.
+static void profileLoop(const ExprAST &For, BranchInst *Entry,
+                        BranchInst *BackEdge) {
+  if (!CurProfile)
+    return;
+  auto &Counts = CurProfile->Loops[{For.getLine(), For.getCol()}];
+  if (ApplyProfile) {
+    uint64_t Taken = Counts.second - std::min(Counts.first, Counts.second);
+    return BackEdge->setMetadata(LLVMContext::MD_prof,
+                                 getBranchWeights(Taken, Counts.first));
+  }
+  IRBuilder<> EntryB(Entry);
+  emitCounter(EntryB, Counts.first);
+  IRBuilder<> LatchB(BackEdge);
+  emitCounter(LatchB, Counts.second);
+}
+
+/// printProfiles - Print the counts of every definition, for ':profile'.
+static void printProfiles() {
+  for (const auto &P : Profiles) {
+    const FunctionProfile &FP = *P.second;
+    fprintf(stderr, "%s: %llu calls%s\n", P.first.c_str(),
+            (unsigned long long)FP.Calls, FP.Optimized ? " (optimized)" : "");
+    for (const auto &A : FP.Arms)
+      fprintf(stderr, "  if at %d:%d: then %llu, else %llu\n", A.first.first,
+              A.first.second, (unsigned long long)A.second.first,
+              (unsigned long long)A.second.second);
+    for (const auto &L : FP.Loops)
+      fprintf(stderr, "  for at %d:%d: %llu entries, %llu iterations\n",
+              L.first.first, L.first.second,
+              (unsigned long long)L.second.first,
+              (unsigned long long)L.second.second);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation
+//===----------------------------------------------------------------------===//
+
+Value *LogErrorV(const char *Str) {
+  LogError(Str);
+  return nullptr;
+}
+
+Function *getFunction(std::string Name) {
+  // First, see if the function has already been added to the current module.
+  if (auto *F = TheModule->getFunction(Name))
+    return F;
+
+  // If not, check whether we can codegen the declaration from some existing
+  // prototype.
+  auto FI = FunctionProtos.find(Name);
+  if (FI != FunctionProtos.end())
+    return FI->second->codegen();
+
+  // If no existing prototype exists, return null.
+  return nullptr;
+}
+
+/// getLLVMType - Return the LLVM type used to hold a value of type Ty.  int is
+/// a 64 bit signed integer and bool is an i1.
+static Type *getLLVMType(ValueType Ty) {
+  switch (Ty) {
+  case type_int:
+    return Type::getInt64Ty(*TheContext);
+  case type_bool:
+    return Type::getInt1Ty(*TheContext);
+  case type_array:
+    return StructType::get(Type::getDoublePtrTy(*TheContext),
+                           Type::getInt64Ty(*TheContext));
+  default:
+    return Type::getDoubleTy(*TheContext);
+  }
+}
+
+/// getFunctionType - Return the type of a function with the given argument and
+/// return types.  An array is passed as two arguments, double* and i64, so that
+/// host code can call it as double f(double *A, int64_t ALen).
+static FunctionType *getFunctionType(const std::vector<ValueType> &ArgTypes,
+                                     ValueType RetType) {
+  std::vector<Type *> ArgTys;
+  for (ValueType Ty : ArgTypes) {
+    if (Ty == type_array) {
+      ArgTys.push_back(Type::getDoublePtrTy(*TheContext));
+      ArgTys.push_back(Type::getInt64Ty(*TheContext));
+    } else
+      ArgTys.push_back(getLLVMType(Ty));
+  }
+  return FunctionType::get(getLLVMType(RetType), ArgTys, false);
+}
+
+/// addExtensionAttributes - Mark the bool arguments and result of F, whose
+/// Kaleidoscope types are ArgTypes and RetType, zeroext.  Without it the ABI
+/// leaves the bits of the register above an i1 undefined, while a C++ bool is
+/// 0 or 1 in the whole byte, so host code that calls F, or that F calls, could
+/// read garbage.
+static void addExtensionAttributes(Function &F,
+                                   const std::vector<ValueType> &ArgTypes,
+                                   ValueType RetType) {
+  if (RetType == type_bool)
+    F.addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
+  unsigned ArgNo = 0;
+  for (ValueType Ty : ArgTypes) {
+    if (Ty == type_bool)
+      F.addParamAttr(ArgNo, Attribute::ZExt);
+    ArgNo += Ty == type_array ? 2 : 1;
+  }
+}
+
+/// getRuntimeFunction - Return the declaration of a host runtime function used
+/// by generated code, adding it to the current module if needed.
+static Function *getRuntimeFunction(const std::string &Name,
+                                    FunctionType *FT) {
+  if (Function *F = TheModule->getFunction(Name))
+    return F;
+  return Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+}
+
+/// getMathIntrinsic - If F is a libm function that has been declared with
+/// 'extern' but not defined, return the declaration of the LLVM intrinsic that
+/// computes the same.  LLVM knows that an intrinsic has no side effects, so it
+/// can fold, hoist and vectorize the call, and emit an instruction for it
+/// where the target has one, like sqrtsd.
+static Function *getMathIntrinsic(const Function &F) {
+  static const std::map<std::string, std::pair<Intrinsic::ID, unsigned>>
+      MathIntrinsics = {
+          {"sqrt", {Intrinsic::sqrt, 1}},
+          {"sin", {Intrinsic::sin, 1}},
+          {"cos", {Intrinsic::cos, 1}},
+          {"exp", {Intrinsic::exp, 1}},
+          {"exp2", {Intrinsic::exp2, 1}},
+          {"log", {Intrinsic::log, 1}},
+          {"log2", {Intrinsic::log2, 1}},
+          {"log10", {Intrinsic::log10, 1}},
+          {"fabs", {Intrinsic::fabs, 1}},
+          {"floor", {Intrinsic::floor, 1}},
+          {"ceil", {Intrinsic::ceil, 1}},
+          {"trunc", {Intrinsic::trunc, 1}},
+          {"rint", {Intrinsic::rint, 1}},
+          {"round", {Intrinsic::round, 1}},
+          {"nearbyint", {Intrinsic::nearbyint, 1}},
+          {"pow", {Intrinsic::pow, 2}},
+          {"fmin", {Intrinsic::minnum, 2}},
+          {"fmax", {Intrinsic::maxnum, 2}},
+          {"copysign", {Intrinsic::copysign, 2}},
+          {"fma", {Intrinsic::fma, 3}}};
+
+  std::string Name = F.getName().str();
+  auto It = MathIntrinsics.find(Name);
+  if (It == MathIntrinsics.end() || !F.isDeclaration() ||
+      DefinitionCount.count(Name) || F.arg_size() != It->second.second)
+    return nullptr;
+
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  if (F.getReturnType() != DoubleTy)
+    return nullptr;
+  for (const auto &Arg : F.args())
+    if (Arg.getType() != DoubleTy)
+      return nullptr;
+  return Intrinsic::getDeclaration(TheModule.get(), It->second.first, DoubleTy);
+}
+
+/// getHostAddress - The address of a function of the host, for the JIT.
+template <typename T> static JITTargetAddress getHostAddress(T *Fn) {
+  return static_cast<JITTargetAddress>(reinterpret_cast<uintptr_t>(Fn));
+}
+
+/// HostFunction - A function of the host that Kaleidoscope code can declare
+/// with 'extern', and what the compiler may assume about calling it.
+struct HostFunction {
+  std::vector<ValueType> ArgTypes;
+  ValueType RetType;
+  std::vector<Attribute::AttrKind> Attrs;
+};
+
+/// HostFunctions - The functions given to registerHostFunction, by name.
+static std::map<std::string, HostFunction> HostFunctions;
+
+/// registerHostFunction - Make the host function at Address callable as Name.
+/// The JIT resolves Name to Address without searching the process, and the
+/// declarations of Name get Attrs if they match the signature, e.g. ReadNone
+/// and NoUnwind for a pure function, so that the optimizer can merge calls to
+/// it and hoist them out of loops.
+static void registerHostFunction(const std::string &Name, void *Address,
+                                 std::vector<ValueType> ArgTypes,
+                                 ValueType RetType,
+                                 std::vector<Attribute::AttrKind> Attrs) {
+  HostFunctions[Name] = {std::move(ArgTypes), RetType, std::move(Attrs)};
+  TheJIT->addHostSymbol(Name, getHostAddress(Address));
+}
+
+/// addHostAttributes - If F declares a registered host function with the
+/// signature it was registered with, give F its attributes.  A definition of
+/// the same name replaces the host function, so F must not have one, the same
+/// as for getMathIntrinsic.
+static void addHostAttributes(Function &F) {
+  std::string Name = F.getName().str();
+  auto It = HostFunctions.find(Name);
+  if (It == HostFunctions.end() || !F.isDeclaration() ||
+      DefinitionCount.count(Name))
+    return;
+
+  const HostFunction &HF = It->second;
+  if (F.getFunctionType() != getFunctionType(HF.ArgTypes, HF.RetType))
+    return;
+  for (Attribute::AttrKind Kind : HF.Attrs)
+    F.addFnAttr(Kind);
+  addExtensionAttributes(F, HF.ArgTypes, HF.RetType);
+}
+
+/// isSmallInteger - Return true if D has no fractional part and is at most
+/// 2^53 in magnitude, where doubles still hold every integer.  A larger
+/// constant stays a double, so that multiplying an int by 10^18 is not an int
+/// multiply that silently wraps.
+static bool isSmallInteger(double D) {
+  return D == std::trunc(D) && std::fabs(D) <= 9007199254740992.0;
+}
+
+/// isIntegralFP - Return true if V is a floating point constant that
+/// isSmallInteger.
+static bool isIntegralFP(Value *V) {
+  auto *C = dyn_cast<ConstantFP>(V);
+  if (!C)
+    return false;
+  return isSmallInteger(C->getValueAPF().convertToDouble());
+}
+
+/// CreateConversion - Convert V to DestTy.  Anything converts to bool by
+/// comparing non-equal to zero, bool widens to 0/1, and int and double convert
+/// as in C.  Arrays do not convert to anything, so this returns null after
+/// reporting an error if either type is an array.
+static Value *CreateConversion(IRBuilder<> &B, Value *V, Type *DestTy) {
+  Type *SrcTy = V->getType();
+  if (SrcTy == DestTy)
+    return V;
+
+  if (SrcTy->isStructTy() || DestTy->isStructTy())
+    return LogErrorV("An array cannot be used as a number");
+
+  if (DestTy->isIntegerTy(1)) {
+    if (SrcTy->isDoubleTy())
+      return B.CreateFCmpONE(V, ConstantFP::get(SrcTy, 0.0), "tobool");
+    return B.CreateICmpNE(V, ConstantInt::get(SrcTy, 0), "tobool");
+  }
+
+  if (DestTy->isDoubleTy()) {
+    if (SrcTy->isIntegerTy(1))
+      return B.CreateUIToFP(V, DestTy, "booltmp");
+    return B.CreateSIToFP(V, DestTy, "inttmp");
+  }
+
+  if (SrcTy->isIntegerTy(1))
+    return B.CreateZExt(V, DestTy, "booltmp");
+  return B.CreateFPToSI(V, DestTy, "inttmp");
+}
+
+/// getArithmeticType - Return the type a builtin binary operator computes in.
+/// Integer operations are used when neither side is a double, where a double
+/// constant with no fractional part takes the integer type of the other side
+/// (so "i+1" stays an integer add) if isSmallInteger, and bool is promoted to
+/// int.
+static Type *getArithmeticType(Value *L, Value *R) {
+  bool LIsInt = L->getType()->isIntegerTy() || isIntegralFP(L);
+  bool RIsInt = R->getType()->isIntegerTy() || isIntegralFP(R);
+  if (LIsInt && RIsInt &&
+      (L->getType()->isIntegerTy() || R->getType()->isIntegerTy()))
+    return Type::getInt64Ty(*TheContext);
+  return Type::getDoubleTy(*TheContext);
+}
+
+/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
+/// the function.  This is used for mutable variables etc.
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
+                                          const std::string &VarName,
+                                          Type *Ty) {
+  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                   TheFunction->getEntryBlock().begin());
+  return TmpB.CreateAlloca(Ty, nullptr, VarName);
+}
+
+Value *NumberExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  return ConstantFP::get(*TheContext, APFloat(Val));
+}
+
+bool NumberExprAST::isIntegralConstant() const { return isSmallInteger(Val); }
+
+bool BinaryExprAST::assigns(const std::string &Name) const {
+  if (Op == '=' && LHS->isVariable(Name))
+    return true;
+  return LHS->assigns(Name) || RHS->assigns(Name);
+}
+
+bool ForExprAST::assigns(const std::string &Name) const {
+  if (Start->assigns(Name))
+    return true;
+  // Inside the loop Name refers to the loop variable if it is shadowed.
+  if (VarName == Name)
+    return false;
+  return End->assigns(Name) || (Step && Step->assigns(Name)) ||
+         Body->assigns(Name);
+}
+
+bool VarExprAST::assigns(const std::string &Name) const {
+  for (auto &Var : VarNames) {
+    if (Var.second && Var.second->assigns(Name))
+      return true;
+    if (Var.first == Name)
+      return false;
+  }
+  return Body->assigns(Name);
+}
+
+Value *ExprAST::codegenStore(Value *Val) {
+  return LogErrorV("destination of '=' must be a variable");
+}
+
+Value *VariableExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  // Look this variable up in the function.
+  Value *V = NamedValues[Name];
+  if (!V)
+    return LogErrorV("Unknown variable name");
+
+  // A loop variable that is never assigned is its PHI node, everything else
+  // lives in an alloca.
+  if (!isa<AllocaInst>(V))
+    return V;
+
+  // Load the value.
+  return Builder->CreateLoad(V, Name.c_str());
+}
+
+Value *VariableExprAST::codegenStore(Value *Val) {
+  // Look up the name.
+  AllocaInst *Variable = dyn_cast_or_null<AllocaInst>(NamedValues[Name]);
+  if (!Variable)
+    return LogErrorV("Unknown variable name");
+
+  Val = CreateConversion(*Builder, Val, Variable->getAllocatedType());
+  if (!Val)
+    return nullptr;
+  Builder->CreateStore(Val, Variable);
+  return Val;
+}
+
+/// codegenAddress - Emit the address of the element, after checking that the
+/// index is in bounds.  The check is an unsigned compare against the length
+/// branching to a noreturn error call, which is the shape the inductive range
+/// check elimination pass looks for to remove checks from loops.  A double
+/// index must also be a whole number.
+Value *IndexExprAST::codegenAddress() {
+  Type *I64 = Type::getInt64Ty(*TheContext);
+  Value *IndexV = Index->codegen();
+  if (!IndexV)
+    return nullptr;
+  if (!IndexV->getType()->isDoubleTy()) {
+    IndexV = CreateConversion(*Builder, IndexV, I64);
+    if (!IndexV)
+      return nullptr;
+  }
+
+  Value *V = NamedValues[Name];
+  if (!V)
+    return LogErrorV("Unknown variable name");
+  Value *Array = isa<AllocaInst>(V) ? Builder->CreateLoad(V, Name.c_str()) : V;
+  if (!Array->getType()->isStructTy())
+    return LogErrorV("Only arrays can be indexed");
+  Value *Data = Builder->CreateExtractValue(Array, 0, Name + ".data");
+  Value *Length = Builder->CreateExtractValue(Array, 1, Name + ".len");
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *FailBB = BasicBlock::Create(*TheContext, "outofbounds");
+  BasicBlock *InBoundsBB =
+      BasicBlock::Create(*TheContext, "inbounds", TheFunction);
+  MDNode *Weights = MDBuilder(*TheContext).createBranchWeights(1 << 20, 1);
+
+  const char *ErrorName = "kaleidoscope_bounds_error";
+  Value *ErrorArgs[] = {IndexV, Length};
+  Value *InBounds;
+  if (IndexV->getType()->isDoubleTy()) {
+    // fptosi gives poison for NaN and for doubles out of the range of i64,
+    // and the bounds check could then be folded away, so check the range
+    // before converting.  Converting back catches a fractional index.
+    Type *DoubleTy = IndexV->getType();
+    Value *InRange = Builder->CreateAnd(
+        Builder->CreateFCmpOGE(IndexV, ConstantFP::get(DoubleTy, 0.0)),
+        Builder->CreateFCmpOLT(
+            IndexV, ConstantFP::get(DoubleTy, 9223372036854775808.0)),
+        "inrange");
+    BasicBlock *ConvertBB =
+        BasicBlock::Create(*TheContext, "toindex", TheFunction, InBoundsBB);
+    Builder->CreateCondBr(InRange, ConvertBB, FailBB, Weights);
+    Builder->SetInsertPoint(ConvertBB);
+    Value *IndexI = Builder->CreateFPToSI(IndexV, I64, "index");
+    Value *Whole = Builder->CreateFCmpOEQ(
+        Builder->CreateSIToFP(IndexI, DoubleTy), IndexV, "whole");
+    InBounds = Builder->CreateAnd(
+        Whole, Builder->CreateICmpULT(IndexI, Length), "boundscheck");
+    ErrorName = "kaleidoscope_index_error";
+    IndexV = IndexI;
+  } else
+    InBounds = Builder->CreateICmpULT(IndexV, Length, "boundscheck");
+  Builder->CreateCondBr(InBounds, InBoundsBB, FailBB, Weights);
+
+  // Emit the failure path at the end of the function, out of the way.
+  TheFunction->getBasicBlockList().push_back(FailBB);
+  Builder->SetInsertPoint(FailBB);
+  Type *ErrorArgTys[] = {ErrorArgs[0]->getType(), I64};
+  Function *ErrorF = getRuntimeFunction(
+      ErrorName,
+      FunctionType::get(Type::getVoidTy(*TheContext), ErrorArgTys, false));
+  ErrorF->setDoesNotReturn();
+  ErrorF->setDoesNotThrow();
+  ErrorF->addFnAttr(Attribute::Cold);
+  Builder->CreateCall(ErrorF, ErrorArgs);
+  Builder->CreateUnreachable();
+
+  Builder->SetInsertPoint(InBoundsBB);
+  return Builder->CreateInBoundsGEP(Data, IndexV, "eltaddr");
+}
+
+Value *IndexExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  Value *Addr = codegenAddress();
+  if (!Addr)
+    return nullptr;
+  return Builder->CreateLoad(Addr, (Name + ".elt").c_str());
+}
+
+Value *IndexExprAST::codegenStore(Value *Val) {
+  Val = CreateConversion(*Builder, Val, Type::getDoubleTy(*TheContext));
+  if (!Val)
+    return nullptr;
+  Value *Addr = codegenAddress();
+  if (!Addr)
+    return nullptr;
+  Builder->CreateStore(Val, Addr);
+  return Val;
+}
+
+Value *UnaryExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  Value *OperandV = Operand->codegen();
+  if (!OperandV)
+    return nullptr;
+
+  Function *F = getFunction(std::string("unary") + Opcode);
+  if (!F)
+    return LogErrorV("Unknown unary operator");
+
+  OperandV = CreateConversion(*Builder, OperandV,
+                              F->getFunctionType()->getParamType(0));
+  if (!OperandV)
+    return nullptr;
+  return Builder->CreateCall(F, OperandV, "unop");
+}
+
+Value *BinaryExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  // Special case '=' because we don't want to emit the LHS as an expression.
+  // The LHS must be a variable or an array element, and knows how to store.
+  if (Op == '=') {
+    // Codegen the RHS.
+    Value *Val = RHS->codegen();
+    if (!Val)
+      return nullptr;
+
+    return LHS->codegenStore(Val);
+  }
+
+  Value *L = LHS->codegen();
+  Value *R = RHS->codegen();
+  if (!L || !R)
+    return nullptr;
+
+  switch (Op) {
+  case '+':
+  case '-':
+  case '*':
+  case '<': {
+    Type *Ty = getArithmeticType(L, R);
+    L = CreateConversion(*Builder, L, Ty);
+    R = CreateConversion(*Builder, R, Ty);
+    if (!L || !R)
+      return nullptr;
+
+    if (Ty->isIntegerTy()) {
+      switch (Op) {
+      case '+':
+        return Builder->CreateAdd(L, R, "addtmp");
+      case '-':
+        return Builder->CreateSub(L, R, "subtmp");
+      case '*':
+        return Builder->CreateMul(L, R, "multmp");
+      default:
+        return Builder->CreateICmpSLT(L, R, "cmptmp");
+      }
+    }
+
+    switch (Op) {
+    case '+':
+      return Builder->CreateFAdd(L, R, "addtmp");
+    case '-':
+      return Builder->CreateFSub(L, R, "subtmp");
+    case '*':
+      return Builder->CreateFMul(L, R, "multmp");
+    default:
+      // The result is a bool, converted to 0.0 or 1.0 where a double is needed.
+      return Builder->CreateFCmpULT(L, R, "cmptmp");
+    }
+  }
+  default:
+    break;
+  }
+
+  // If it wasn't a builtin binary operator, it must be a user defined one. Emit
+  // a call to it.
+  Function *F = getFunction(std::string("binary") + Op);
+  assert(F && "binary operator not found!");
+
+  L = CreateConversion(*Builder, L, F->getFunctionType()->getParamType(0));
+  R = CreateConversion(*Builder, R, F->getFunctionType()->getParamType(1));
+  if (!L || !R)
+    return nullptr;
+  Value *Ops[] = {L, R};
+  return Builder->CreateCall(F, Ops, "binop");
+}
+
+/// ArraySlots - For each 'array(n)' in the function being generated, an entry
+/// block slot that holds its data once it is allocated, and null before.
+/// freeArrays frees them when the function returns.
+static std::vector<AllocaInst *> ArraySlots;
+
+/// LoopDepth - How many for loops the code being generated is in.
+static unsigned LoopDepth = 0;
+
+/// codegenBuiltin - Emit the builtins 'len(a)', the length of an array as an
+/// int, and 'array(n)', which allocates a zero-filled array of n doubles from
+/// the host.  Such arrays are freed when the function that allocated them
+/// returns.  Returns null without an error if this is not a builtin call.
+static Value *codegenBuiltin(const std::string &Callee,
+                             std::vector<std::unique_ptr<ExprAST>> &Args,
+                             bool &Error) {
+  if ((Callee != "len" && Callee != "array") || Args.size() != 1)
+    return nullptr;
+
+  Value *ArgV = Args[0]->codegen();
+  if (!ArgV) {
+    Error = true;
+    return nullptr;
+  }
+
+  if (Callee == "len") {
+    if (!ArgV->getType()->isStructTy()) {
+      Error = true;
+      return LogErrorV("len() requires an array");
+    }
+    return Builder->CreateExtractValue(ArgV, 1, "len");
+  }
+
+  // Every iteration of a loop would allocate another array, but the slot only
+  // keeps the last one.
+  if (LoopDepth) {
+    Error = true;
+    return LogErrorV("array() cannot be used inside a for loop");
+  }
+
+  Type *I64 = Type::getInt64Ty(*TheContext);
+  Value *Length = CreateConversion(*Builder, ArgV, I64);
+  if (!Length) {
+    Error = true;
+    return nullptr;
+  }
+  Function *AllocF = getRuntimeFunction(
+      "kaleidoscope_alloc_array",
+      FunctionType::get(Type::getDoublePtrTy(*TheContext), {I64}, false));
+  Value *Data = Builder->CreateCall(AllocF, Length, "data");
+
+  // Remember the data in a slot that is null until here, for freeArrays.
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock &Entry = TheFunction->getEntryBlock();
+  IRBuilder<> TmpB(&Entry, Entry.begin());
+  AllocaInst *Slot = TmpB.CreateAlloca(Data->getType(), nullptr, "array.slot");
+  TmpB.CreateStore(Constant::getNullValue(Data->getType()), Slot);
+  Builder->CreateStore(Data, Slot);
+  ArraySlots.push_back(Slot);
+
+  Value *Array = UndefValue::get(getLLVMType(type_array));
+  Array = Builder->CreateInsertValue(Array, Data, 0);
+  return Builder->CreateInsertValue(Array, Length, 1, "array");
+}
+
+Value *CallExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  bool Error = false;
+  if (Value *V = codegenBuiltin(Callee, Args, Error))
+    return V;
+  if (Error)
+    return nullptr;
+
+  // Look up the name in the global module table.
+  Function *CalleeF = getFunction(Callee);
+  if (!CalleeF)
+    return LogErrorV("Unknown function referenced");
+
+  // An array argument is passed as its data pointer followed by its length, so
+  // walk the parameters of the callee alongside the arguments.
+  FunctionType *FTy = CalleeF->getFunctionType();
+  std::vector<Value *> ArgsV;
+  unsigned Param = 0;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    // If argument mismatch error.
+    if (Param == FTy->getNumParams())
+      return LogErrorV("Incorrect # arguments passed");
+
+    Value *ArgV = Args[i]->codegen();
+    if (!ArgV)
+      return nullptr;
+
+    if (FTy->getParamType(Param)->isPointerTy()) {
+      if (!ArgV->getType()->isStructTy())
+        return LogErrorV("Expected an array argument");
+      ArgsV.push_back(Builder->CreateExtractValue(ArgV, 0));
+      ArgsV.push_back(Builder->CreateExtractValue(ArgV, 1));
+      Param += 2;
+      continue;
+    }
+
+    ArgV = CreateConversion(*Builder, ArgV, FTy->getParamType(Param++));
+    if (!ArgV)
+      return nullptr;
+    ArgsV.push_back(ArgV);
+  }
+  if (Param != FTy->getNumParams())
+    return LogErrorV("Incorrect # arguments passed");
+
+  if (Function *IntrinsicF = getMathIntrinsic(*CalleeF)) {
+    IntrinsicCalls.insert(Callee);
+    CalleeF = IntrinsicF;
+  } else if (DefinitionCount.count(Callee))
+    // A definition named like a libm function replaces it, so the optimizer
+    // must not fold or transform the call as one, e.g. sqrt(4) to 2.
+    CalleeF->addFnAttr(Attribute::NoBuiltin);
+  else
+    addHostAttributes(*CalleeF);
+  CallInst *Call = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  // Repeat the attributes of the callee on the call.  The code generator only
+  // turns a musttail call into a jump if the call extends a bool result the
+  // same way as the caller does.
+  Call->setAttributes(CalleeF->getAttributes());
+  return Call;
+}
+
+Value *IfExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  Value *CondV = Cond->codegen();
+  if (!CondV)
+    return nullptr;
+
+  // Convert condition to a bool by comparing non-equal to zero.
+  CondV = CreateConversion(*Builder, CondV, Type::getInt1Ty(*TheContext));
+  if (!CondV)
+    return nullptr;
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // Create blocks for the then and else cases.  Insert the 'then' block at the
+  // end of the function.
+  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+
+  profileIf(*this, Builder->CreateCondBr(CondV, ThenBB, ElseBB));
+
+  // Emit then value.
+  Builder->SetInsertPoint(ThenBB);
+  profileArm(*this, true);
+
+  Value *ThenV = Then->codegen();
+  if (!ThenV)
+    return nullptr;
+
+  Builder->CreateBr(MergeBB);
+  // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
+  ThenBB = Builder->GetInsertBlock();
+
+  // Emit else block.
+  TheFunction->getBasicBlockList().push_back(ElseBB);
+  Builder->SetInsertPoint(ElseBB);
+  profileArm(*this, false);
+
+  Value *ElseV = Else->codegen();
+  if (!ElseV)
+    return nullptr;
+
+  Builder->CreateBr(MergeBB);
+  // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
+  ElseBB = Builder->GetInsertBlock();
+
+  // If the arms have different types, convert both to their common type at the
+  // end of each arm.  Mixed arms compute in double as for a binary operator.
+  Type *Ty = ThenV->getType();
+  if (ElseV->getType() != Ty) {
+    Ty = getArithmeticType(ThenV, ElseV);
+    IRBuilder<> ThenB(ThenBB->getTerminator());
+    ThenV = CreateConversion(ThenB, ThenV, Ty);
+    IRBuilder<> ElseB(ElseBB->getTerminator());
+    ElseV = CreateConversion(ElseB, ElseV, Ty);
+    if (!ThenV || !ElseV)
+      return nullptr;
+  }
+
+  // Emit merge block.
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+  PHINode *PN = Builder->CreatePHI(Ty, 2, "iftmp");
+
+  PN->addIncoming(ThenV, ThenBB);
+  PN->addIncoming(ElseV, ElseBB);
+  return PN;
+}
+
+/// CreateReturn - Return V, converted to RetTy, from the current function.
+static bool CreateReturn(Value *V, Type *RetTy) {
+  if (V)
+    V = CreateConversion(*Builder, V, RetTy);
+  if (!V)
+    return false;
+  Builder->CreateRet(V);
+  return true;
+}
+
+bool ExprAST::codegenReturn(Type *RetTy) {
+  return CreateReturn(codegen(), RetTy);
+}
+
+/// A call whose value is returned as it is becomes a tail call.  If the callee
+/// has the same prototype as the caller it is a musttail call, which the code
+/// generator must turn into a jump, so that a chain of them, like mutually
+/// recursive functions, runs in constant stack space.  A call to the function
+/// itself stays a plain tail call, which TailCallElim turns into a loop.
+bool CallExprAST::codegenReturn(Type *RetTy) {
+  Value *V = codegen();
+  auto *CI = dyn_cast_or_null<CallInst>(V);
+  if (!CI || CI->getType() != RetTy || isa<IntrinsicInst>(CI))
+    return CreateReturn(V, RetTy);
+
+  Function *Caller = Builder->GetInsertBlock()->getParent();
+  Function *CalleeF = CI->getCalledFunction();
+  if (CalleeF != Caller &&
+      CalleeF->getFunctionType() == Caller->getFunctionType())
+    CI->setTailCallKind(CallInst::TCK_MustTail);
+  else
+    CI->setTailCallKind(CallInst::TCK_Tail);
+  Builder->CreateRet(CI);
+  return true;
+}
+
+/// In tail position each arm of an 'if' returns its own value, so that the
+/// arms are in tail position too.
+bool IfExprAST::codegenReturn(Type *RetTy) {
+  KSDbgInfo.emitLocation(this);
+  Value *CondV = Cond->codegen();
+  if (CondV)
+    CondV = CreateConversion(*Builder, CondV, Type::getInt1Ty(*TheContext));
+  if (!CondV)
+    return false;
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+  profileIf(*this, Builder->CreateCondBr(CondV, ThenBB, ElseBB));
+
+  Builder->SetInsertPoint(ThenBB);
+  profileArm(*this, true);
+  if (!Then->codegenReturn(RetTy))
+    return false;
+
+  TheFunction->getBasicBlockList().push_back(ElseBB);
+  Builder->SetInsertPoint(ElseBB);
+  profileArm(*this, false);
+  return Else->codegenReturn(RetTy);
+}
+
+/// getLoopID - Return the llvm.loop metadata for the hints of a loop, or null
+/// if it has none.
+static MDNode *getLoopID(const LoopHints &Hints) {
+  if (!Hints.Vectorize && !Hints.Unroll)
+    return nullptr;
+
+  auto MakeHint = [](const char *Name, Constant *Val) -> Metadata * {
+    Metadata *Ops[] = {MDString::get(*TheContext, Name),
+                       ConstantAsMetadata::get(Val)};
+    return MDNode::get(*TheContext, Ops);
+  };
+  Type *I32 = Type::getInt32Ty(*TheContext);
+
+  // The first operand is a reference to the loop ID itself.
+  SmallVector<Metadata *, 4> MDs;
+  MDs.push_back(nullptr);
+  if (Hints.Vectorize) {
+    MDs.push_back(MakeHint("llvm.loop.vectorize.enable",
+                           ConstantInt::getTrue(*TheContext)));
+    if (Hints.VectorizeWidth)
+      MDs.push_back(MakeHint("llvm.loop.vectorize.width",
+                             ConstantInt::get(I32, Hints.VectorizeWidth)));
+  }
+  if (Hints.Unroll) {
+    if (Hints.UnrollCount)
+      MDs.push_back(MakeHint("llvm.loop.unroll.count",
+                             ConstantInt::get(I32, Hints.UnrollCount)));
+    else
+      MDs.push_back(MDNode::get(*TheContext,
+                                MDString::get(*TheContext,
+                                              "llvm.loop.unroll.enable")));
+  }
+
+  MDNode *LoopID = MDNode::getDistinct(*TheContext, MDs);
+  LoopID->replaceOperandWith(0, LoopID);
+  return LoopID;
+}
+
+// Output for-loop in LLVM's canonical rotated form, which the loop passes can
+// use without any cleanup:
+//   ...
+//   start = startexpr
+//   goto preheader
+// preheader:
+//   goto loop
+// loop:
+//   var = phi [start, preheader], [nextvar, loopend]
+//   ...
+//   bodyexpr
+//   ...
+// loopend:
+//   step = stepexpr
+//   endcond = endexpr
+//   nextvar = var + step
+//   br endcond, loop, loopexit
+// loopexit:
+//   goto afterloop
+// afterloop:
+// As in the tutorial the body always runs once, and the end condition is only
+// emitted in the latch, so it is evaluated once per iteration.
+// With an integer variable and a constant step, the latch is an add nsw and an
+// integer compare, so the trip count is computable.  If anything assigns to
+// the variable it lives in an alloca instead, and mem2reg gives the same shape.
+Value *ForExprAST::codegen() {
+  KSDbgInfo.emitLocation(this);
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // Emit the start code first, without 'variable' in scope.
+  Value *StartVal = Start->codegen();
+  if (!StartVal)
+    return nullptr;
+
+  bool Assigned = End->assigns(VarName) || (Step && Step->assigns(VarName)) ||
+                  Body->assigns(VarName);
+
+  // Without an annotation and with --infer-int, count in integers when the
+  // start value is an integer, the step is an integer constant (or the default
+  // 1), and nothing stores a possibly fractional value into the variable.
+  Type *VarTy = getLLVMType(VarType);
+  if (VarType == type_infer && InferInt) {
+    bool IntStart =
+        StartVal->getType()->isIntegerTy(64) || isIntegralFP(StartVal);
+    bool IntStep = !Step || Step->isIntegralConstant();
+    if (IntStart && IntStep && !Assigned)
+      VarTy = Type::getInt64Ty(*TheContext);
+  }
+
+  StartVal = CreateConversion(*Builder, StartVal, VarTy);
+  if (!StartVal)
+    return nullptr;
+
+  // Create an alloca for an assigned variable in the entry block, and store
+  // the value into it.
+  AllocaInst *Alloca = nullptr;
+  if (Assigned) {
+    Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+    Builder->CreateStore(StartVal, Alloca);
+  }
+
+  // Make the preheader and the loop header after the current block, and the
+  // block after the loop, which is inserted once the body is done.
+  BasicBlock *PreheaderBB =
+      BasicBlock::Create(*TheContext, "preheader", TheFunction);
+  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop");
+  Builder->CreateBr(PreheaderBB);
+
+  // The preheader only enters the loop.
+  Builder->SetInsertPoint(PreheaderBB);
+  BranchInst *Entry = Builder->CreateBr(LoopBB);
+
+  // Start insertion in LoopBB.
+  Builder->SetInsertPoint(LoopBB);
+
+  // Start the PHI node with an entry for Start.
+  PHINode *Variable = nullptr;
+  if (!Alloca) {
+    Variable = Builder->CreatePHI(VarTy, 2, VarName);
+    Variable->addIncoming(StartVal, PreheaderBB);
+  }
+
+  // Within the loop, the variable is defined equal to the PHI node.  If it
+  // shadows an existing variable, we have to restore it, so save it now.
+  Value *OldVal = NamedValues[VarName];
+  if (Alloca)
+    NamedValues[VarName] = Alloca;
+  else
+    NamedValues[VarName] = Variable;
+
+  // Emit the body of the loop.  This, like any other expr, can change the
+  // current BB.  Note that we ignore the value computed by the body, but don't
+  // allow an error.  The body, the step and the end condition run on every
+  // iteration.
+  ++LoopDepth;
+  if (!Body->codegen())
+    return nullptr;
+
+  // Emit the step value.
+  Value *StepVal = nullptr;
+  if (Step) {
     StepVal = Step->codegen();
     if (!StepVal)
       return nullptr;
   } else {
     // If not specified, use 1.0.
-    StepVal = ConstantFP::get(TheContext, APFloat(1.0));
+    StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
   }
+  StepVal = CreateConversion(*Builder, StepVal, VarTy);
+  if (!StepVal)
+    return nullptr;
 
   // Compute the end condition.
   Value *EndCond = End->codegen();
+  if (!EndCond)
+    return nullptr;
+  --LoopDepth;
+
+  // Increment the variable.  If it lives in an alloca, reload it and store it
+  // back, which handles the case where the body of the loop mutates it.  The
+  // latch belongs to the 'for' itself.
+  KSDbgInfo.emitLocation(this);
+  Value *CurVar = Variable;
+  if (Alloca)
+    CurVar = Builder->CreateLoad(Alloca, VarName.c_str());
+  Value *NextVar = VarTy->isIntegerTy()
+                       ? Builder->CreateNSWAdd(CurVar, StepVal, "nextvar")
+                       : Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+  if (Alloca)
+    Builder->CreateStore(NextVar, Alloca);
+
+  // Convert condition to a bool by comparing non-equal to zero.
+  EndCond = CreateConversion(*Builder, EndCond, Type::getInt1Ty(*TheContext));
   if (!EndCond)
     return nullptr;
 
-  // Reload, increment, and restore the alloca.  This handles the case where
-  // the body of the loop mutates the variable.
-  Value *CurVar = Builder.CreateLoad(Alloca, VarName.c_str());
-  Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
-  Builder.CreateStore(NextVar, Alloca);
+  // Create the exit block, which only the loop branches to.
+  BasicBlock *LoopEndBB = Builder->GetInsertBlock();
+  BasicBlock *ExitBB = BasicBlock::Create(*TheContext, "loopexit", TheFunction);
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  EndCond = Builder.CreateFCmpONE(
-      EndCond, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
+  // Insert the conditional branch into the end of LoopEndBB.  The loop hints
+  // go on this backedge.
+  BranchInst *BackEdge = Builder->CreateCondBr(EndCond, LoopBB, ExitBB);
+  if (MDNode *LoopID = getLoopID(Hints))
+    BackEdge->setMetadata(LLVMContext::MD_loop, LoopID);
+  profileLoop(*this, Entry, BackEdge);
 
-  // Create the "after loop" block and insert it.
-  BasicBlock *AfterBB =
-      BasicBlock::Create(TheContext, "afterloop", TheFunction);
+  // Add a new entry to the PHI node for the backedge.
+  if (Variable)
+    Variable->addIncoming(NextVar, LoopEndBB);
 
-  // Insert the conditional branch into the end of LoopEndBB.
-  Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+  Builder->SetInsertPoint(ExitBB);
+  Builder->CreateBr(AfterBB);
 
   // Any new code will be inserted in AfterBB.
-  Builder.SetInsertPoint(AfterBB);
+  TheFunction->getBasicBlockList().push_back(AfterBB);
+  Builder->SetInsertPoint(AfterBB);
 
   // Restore the unshadowed variable.
   if (OldVal)
@@ -986,18 +2910,20 @@ Value *ForExprAST::codegen() {
     NamedValues.erase(VarName);
 
   // for expr always returns 0.0.
-  return Constant::getNullValue(Type::getDoubleTy(TheContext));
+  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
 
 Value *VarExprAST::codegen() {
-  std::vector<AllocaInst *> OldBindings;
+  KSDbgInfo.emitLocation(this);
+  std::vector<Value *> OldBindings;
 
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
   // Register all variables and emit their initializer.
   for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
     const std::string &VarName = VarNames[i].first;
     ExprAST *Init = VarNames[i].second.get();
+    Type *VarTy = getLLVMType(VarTypes[i]);
 
     // Emit the initializer before adding the variable to scope, this prevents
     // the initializer from referencing the variable itself, and permits stuff
@@ -1009,12 +2935,27 @@ Value *VarExprAST::codegen() {
       InitVal = Init->codegen();
       if (!InitVal)
         return nullptr;
-    } else { // If not specified, use 0.0.
-      InitVal = ConstantFP::get(TheContext, APFloat(0.0));
+    } else { // If not specified, use 0.0 (or zero of the annotated type).
+      InitVal = Constant::getNullValue(VarTy);
+    }
+
+    // Without an annotation, an int initializer makes an int variable unless
+    // the variable is assigned later on.  Arrays always stay arrays.
+    if (VarTypes[i] == type_infer && InitVal->getType()->isStructTy())
+      VarTy = InitVal->getType();
+    if (VarTypes[i] == type_infer && InitVal->getType()->isIntegerTy(64)) {
+      bool Assigned = Body->assigns(VarName);
+      for (unsigned j = i + 1; j != e && !Assigned; ++j)
+        Assigned = VarNames[j].second && VarNames[j].second->assigns(VarName);
+      if (!Assigned)
+        VarTy = InitVal->getType();
     }
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    Builder.CreateStore(InitVal, Alloca);
+    InitVal = CreateConversion(*Builder, InitVal, VarTy);
+    if (!InitVal)
+      return nullptr;
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+    Builder->CreateStore(InitVal, Alloca);
 
     // Remember the old variable binding so that we can restore the binding when
     // we unrecurse.
@@ -1038,27 +2979,75 @@ Value *VarExprAST::codegen() {
 }
 
 Function *PrototypeAST::codegen() {
-  // Make the function type:  double(double,double) etc.
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(TheContext));
-  FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
+  // Make the function type:  double(double,double), i64(i64,double) etc.
+  FunctionType *FT = getFunctionType(ArgTypes, RetType);
 
   Function *F =
       Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
 
   // Set names for all arguments.
-  unsigned Idx = 0;
-  for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+  auto ArgIt = F->arg_begin();
+  for (unsigned Idx = 0, e = Args.size(); Idx != e; ++Idx) {
+    (ArgIt++)->setName(Args[Idx]);
+    if (ArgTypes[Idx] == type_array)
+      (ArgIt++)->setName(Args[Idx] + ".len");
+  }
+  addExtensionAttributes(*F, ArgTypes, RetType);
+
+  return F;
+}
+
+/// declarePrototype - Make P the prototype of its name, unless the name has
+/// another one.  Code compiled before calls the function through its stub with
+/// the old prototype, so a definition or extern cannot change it.
+bool declarePrototype(std::unique_ptr<PrototypeAST> P) {
+  auto &Slot = FunctionProtos[P->getName()];
+  if (Slot && (Slot->getArgTypes() != P->getArgTypes() ||
+               Slot->getReturnType() != P->getReturnType())) {
+    LogError(("'" + P->getName() + "' is already declared with another "
+              "prototype").c_str());
+    return false;
+  }
+  Slot = std::move(P);
+  return true;
+}
 
-  return F;
+/// freeArrays - Free the arrays that F allocated before each of its returns.
+/// Nothing can refer to them afterwards, since arrays cannot be returned or
+/// stored anywhere but in the variables of F and the arguments of its calls.
+/// A call whose value is returned is no longer the last thing before the
+/// return, so it cannot stay a musttail call.
+static void freeArrays(Function *F) {
+  if (ArraySlots.empty())
+    return;
+  Type *DoublePtr = Type::getDoublePtrTy(*TheContext);
+  Function *FreeF = getRuntimeFunction(
+      "kaleidoscope_free_array",
+      FunctionType::get(Type::getVoidTy(*TheContext), {DoublePtr}, false));
+  for (BasicBlock &BB : *F) {
+    auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator());
+    if (!Ret)
+      continue;
+    if (auto *CI = dyn_cast_or_null<CallInst>(Ret->getPrevNode()))
+      if (CI->isMustTailCall())
+        CI->setTailCallKind(CallInst::TCK_Tail);
+    IRBuilder<> B(Ret);
+    for (AllocaInst *Slot : ArraySlots)
+      B.CreateCall(FreeF, B.CreateLoad(Slot));
+  }
 }
 
 Function *FunctionAST::codegen() {
-  // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-  // reference to it for use below.
+  // Copy the prototype to the FunctionProtos map, keeping this one so that
+  // --profile can compile the definition again.
   auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
+  if (IntrinsicCalls.count(P.getName())) {
+    LogError(("'" + P.getName() + "' cannot be defined, calls to it have been "
+              "compiled as an intrinsic").c_str());
+    return nullptr;
+  }
+  if (!declarePrototype(llvm::make_unique<PrototypeAST>(P)))
+    return nullptr;
   Function *TheFunction = getFunction(P.getName());
   if (!TheFunction)
     return nullptr;
@@ -1068,31 +3057,101 @@ Function *FunctionAST::codegen() {
     BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
 
   // Create a new basic block to start insertion into.
-  BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
-  Builder.SetInsertPoint(BB);
+  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+  Builder->SetInsertPoint(BB);
+
+  // Create a subprogram DIE for this function.
+  DISubprogram *SP = nullptr;
+  if (DBuilder) {
+    unsigned LineNo = P.getLine();
+    SP = DBuilder->createFunction(
+        KSDbgInfo.Unit, P.getName(), StringRef(), KSDbgInfo.Unit, LineNo,
+        KSDbgInfo.getFunctionType(P), false /* internal linkage */,
+        true /* definition */, LineNo, DINode::FlagPrototyped,
+        true /* optimized */);
+    TheFunction->setSubprogram(SP);
+
+    // Push the current scope.
+    KSDbgInfo.LexicalBlocks.push_back(SP);
+
+    // Unset the location for the prologue emission (leading instructions with
+    // no location in a function are considered part of the prologue and the
+    // debugger will run past them when breaking on a function)
+    KSDbgInfo.emitLocation(nullptr);
+  }
+  profileFunction(TheFunction);
+
+  // Allow unsafe floating point optimizations for every function with
+  // --fast-math, or for this one with 'def [fastmath] ...'.  The attributes
+  // let the code generator do the same.
+  FastMathFlags FMF;
+  if (FastMath || P.isFastMath()) {
+    FMF.setFast();
+    for (const char *Attr : {"unsafe-fp-math", "no-nans-fp-math",
+                             "no-infs-fp-math", "no-signed-zeros-fp-math"})
+      TheFunction->addFnAttr(Attr, "true");
+  }
+  Builder->setFastMathFlags(FMF);
 
   // Record the function arguments in the NamedValues map.
   NamedValues.clear();
-  for (auto &Arg : TheFunction->args()) {
+  ArraySlots.clear();
+  LoopDepth = 0;
+  auto ArgIt = TheFunction->arg_begin();
+  unsigned ArgIdx = 0;
+  for (auto &ArgName : P.getArgs()) {
+    Value *ArgV = &*ArgIt++;
+
+    // Put an array back together from its data pointer and length.
+    if (ArgV->getType()->isPointerTy()) {
+      Value *Array = UndefValue::get(getLLVMType(type_array));
+      Array = Builder->CreateInsertValue(Array, ArgV, 0);
+      ArgV = Builder->CreateInsertValue(Array, &*ArgIt++, 1, ArgName);
+    }
+
     // Create an alloca for this variable.
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+    AllocaInst *Alloca =
+        CreateEntryBlockAlloca(TheFunction, ArgName, ArgV->getType());
+
+    // Create a debug descriptor for the variable.
+    if (SP) {
+      DILocalVariable *D = DBuilder->createParameterVariable(
+          SP, ArgName, ArgIdx + 1, KSDbgInfo.Unit, P.getLine(),
+          KSDbgInfo.getType(P.getArgTypes()[ArgIdx]), true);
+      DBuilder->insertDeclare(Alloca, D, DBuilder->createExpression(),
+                              DILocation::get(*TheContext, P.getLine(), 0, SP),
+                              Builder->GetInsertBlock());
+    }
+    ++ArgIdx;
 
     // Store the initial value into the alloca.
-    Builder.CreateStore(&Arg, Alloca);
+    Builder->CreateStore(ArgV, Alloca);
 
     // Add arguments to variable symbol table.
-    NamedValues[Arg.getName()] = Alloca;
+    NamedValues[ArgName] = Alloca;
   }
 
-  if (Value *RetVal = Body->codegen()) {
-    // Finish off the function.
-    Builder.CreateRet(RetVal);
+  KSDbgInfo.emitLocation(Body.get());
+
+  // Return the body, converted to the return type of the function.  The body
+  // is in tail position, and so are the calls that return its value.
+  bool Returned = Body->codegenReturn(TheFunction->getReturnType());
+
+  // Pop off the lexical block for the function.
+  if (SP)
+    KSDbgInfo.LexicalBlocks.pop_back();
+
+  if (Returned) {
+    freeArrays(TheFunction);
 
     // Validate the generated code, checking for consistency.
     verifyFunction(*TheFunction);
 
     // Run the optimizer on the function.
-    TheFPM->run(*TheFunction);
+    {
+      PhaseTimer Timer(phase_optimize);
+      TheFPM->run(*TheFunction);
+    }
 
     return TheFunction;
   }
@@ -1105,18 +3164,106 @@ Function *FunctionAST::codegen() {
   return nullptr;
 }
 
+//===----------------------------------------------------------------------===//
+// Concurrent callers
+//===----------------------------------------------------------------------===//
+
+// Everything above belongs to the thread that compiles.  The threads that call
+// functions through Engine::snapshot share only the JIT, which has its own
+// lock, and TheFunctions.
+
+/// ShareFunctions - Whether other threads call the definitions through
+/// TheFunctions, which Engine::shareFunctions turns on.
+static bool ShareFunctions = false;
+
+/// TheFunctions - The definitions, published for the threads that call them.
+static FunctionTable TheFunctions;
+
+/// DefinitionCode - The code of each definition when no other thread calls
+/// them.  Nothing else can be running a body the REPL replaces then, so it is
+/// freed right away.
+static std::map<std::string, KaleidoscopeJIT::CodeRef> DefinitionCode;
+
+/// getSignature - The TypeCode letters of P in Engine.h: its return type and
+/// then its argument types, with "pi" for an array.
+static std::string getSignature(const PrototypeAST &P) {
+  auto Code = [](ValueType Ty) -> const char * {
+    switch (Ty) {
+    case type_int:
+      return "i";
+    case type_bool:
+      return "b";
+    case type_array:
+      return "pi";
+    default:
+      return "d";
+    }
+  };
+  // A returned array is a struct, which no host type stands for.
+  std::string Signature =
+      P.getReturnType() == type_array ? "?" : Code(P.getReturnType());
+  for (ValueType Ty : P.getArgTypes())
+    Signature += Code(Ty);
+  return Signature;
+}
+
+/// publishFunction - Let the other threads call Name, whose newest body Code
+/// has just been added to the JIT.  The snapshots taken before keep the older
+/// body loaded.
+static void publishFunction(const std::string &Name,
+                            const std::string &Signature,
+                            KaleidoscopeJIT::CodeRef Code) {
+  if (!ShareFunctions) {
+    DefinitionCode[Name] = std::move(Code);
+    return;
+  }
+  auto Sym = TheJIT->findSymbol(Name);
+  assert(Sym && "Function not found");
+  TheFunctions.publish(
+      Name, {cantFail(Sym.getAddress()), Signature, std::move(Code)});
+}
+
 //===----------------------------------------------------------------------===//
 // Top-Level parsing and JIT Driver
 //===----------------------------------------------------------------------===//
 
+static void flushOutput();
+
+/// Echo - Whether to prompt, and to print the IR of each item and the value of
+/// each top-level expression, as the REPL does.  An Engine does not.
+static bool Echo = true;
+
+/// FrontEndTM - With --pipeline, the TargetMachine that the front end
+/// generates and optimizes IR for, while the back end compiles with the JIT's.
+static std::unique_ptr<TargetMachine> FrontEndTM;
+
+/// getIRTarget - The TargetMachine to generate IR for.
+static TargetMachine &getIRTarget() {
+  return FrontEndTM ? *FrontEndTM : TheJIT->getTargetMachine();
+}
+
 static void InitializeModuleAndPassManager() {
+  // Start a new context for the new module.  The JIT has compiled the module
+  // of the old one, so freeing it frees the types, constants and metadata that
+  // module made, which the context would otherwise keep for the whole session.
+  DBuilder.reset();
+  TheFPM.reset();
+  TheModule.reset();
+  Builder.reset();
+  TheContext = llvm::make_unique<LLVMContext>();
+  Builder = llvm::make_unique<IRBuilder<>>(*TheContext);
+
   // Open a new module.
-  TheModule = llvm::make_unique<Module>("my cool jit", TheContext);
-  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+  TheModule = llvm::make_unique<Module>("my cool jit", *TheContext);
+  TheModule->setDataLayout(getIRTarget().createDataLayout());
 
   // Create a new pass manager attached to it.
   TheFPM = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
 
+  // Use the target's cost model.  This has to come before any pass that asks
+  // for it, or the pass manager creates a target independent one instead.
+  TheFPM->add(createTargetTransformInfoWrapperPass(
+      getIRTarget().getTargetIRAnalysis()));
   // Promote allocas to registers.
   TheFPM->add(createPromoteMemoryToRegisterPass());
   // Do simple "peephole" optimizations and bit-twiddling optzns.
@@ -1127,70 +3274,672 @@ static void InitializeModuleAndPassManager() {
   TheFPM->add(createGVNPass());
   // Simplify the control flow graph (deleting unreachable blocks, etc).
   TheFPM->add(createCFGSimplificationPass());
+  // Turn recursive tail calls into loops, so that the loop passes below see
+  // them.
+  TheFPM->add(createTailCallEliminationPass());
+
+  // Hoist loop invariant code, such as the length of an array, out of loops.
+  TheFPM->add(createLICMPass());
+  // Split off the iterations that need array bounds checks, leaving a main
+  // loop without any.
+  TheFPM->add(createInductiveRangeCheckEliminationPass());
+  // Canonicalize induction variables and compute exit values.
+  TheFPM->add(createIndVarSimplifyPass());
+  // Vectorize loops over arrays.  Floating point reductions are only
+  // vectorized with fast-math or a 'for [vectorize]' hint.
+  TheFPM->add(createLoopVectorizePass());
+  // Unroll loops, following 'for [unroll]' hints.
+  TheFPM->add(createLoopUnrollPass());
+  // Clean up after the loop passes.
+  TheFPM->add(createInstructionCombiningPass());
+  TheFPM->add(createCFGSimplificationPass());
 
   TheFPM->doInitialization();
+
+  // Start the debug info of the new module.
+  if (EmitDebugInfo) {
+    // Add the current debug info version into the module.
+    TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
+                             DEBUG_METADATA_VERSION);
+
+    // Darwin only supports dwarf2.
+    if (getIRTarget().getTargetTriple().isOSDarwin())
+      TheModule->addModuleFlag(Module::Warning, "Dwarf Version", 2);
+
+    StringRef SourceName = InputFilename;
+    if (SourceName == "-")
+      SourceName = "<stdin>";
+    DBuilder = llvm::make_unique<DIBuilder>(*TheModule);
+    KSDbgInfo.Unit = DBuilder->createFile(SourceName, ".");
+    KSDbgInfo.TheCU = DBuilder->createCompileUnit(
+        dwarf::DW_LANG_C, KSDbgInfo.Unit, "Kaleidoscope Compiler",
+        true /* optimized */, "", 0);
+    KSDbgInfo.Types.clear();
+  }
+}
+
+/// finalizeDebugInfo - Finish the debug info of the current module before it
+/// is handed to the JIT.
+static void finalizeDebugInfo() {
+  if (DBuilder)
+    DBuilder->finalize();
+}
+
+static cl::opt<bool>
+    Pipeline("pipeline",
+             cl::desc("Parse the next item and generate its IR while a second "
+                      "thread compiles and runs the previous ones"));
+
+static cl::opt<unsigned> ExprCacheSize(
+    "expr-cache",
+    cl::desc("Keep the code of this many top-level expressions, and run it "
+             "again when the same expression is entered (0 to turn off)"),
+    cl::init(64));
+
+/// CachedExpr - The code of a top-level expression in the expression cache.
+/// Key is from FunctionAST::appendKey, and Callees are the functions that the
+/// expression calls, whose declarations the code was compiled against.
+struct CachedExpr {
+  std::string Key;
+  std::set<std::string> Callees;
+  JITTargetAddress Address;
+  KaleidoscopeJIT::ModuleHandleT Module;
+};
+
+/// ExprCache - The cached expressions, the most recently run first.
+/// ExprCacheIndex finds them by key.
+static std::list<CachedExpr> ExprCache;
+static std::unordered_map<std::string, std::list<CachedExpr>::iterator>
+    ExprCacheIndex;
+
+/// DefinitionSource - The key and callees of the definition a function has
+/// now, so that entering the same definition again compiles nothing.
+struct DefinitionSource {
+  std::string Key;
+  std::set<std::string> Callees;
+};
+static std::map<std::string, DefinitionSource> DefinitionSources;
+
+/// PreparedExpr - The code of an expression given to Engine::prepare, shared by
+/// the prepares of the same expression with the same parameters and signature.
+/// Key is made by appendKey, which also gives the functions it calls.
+struct PreparedExpr {
+  std::string Key;
+  std::set<std::string> Callees;
+  JITTargetAddress Address;
+  KaleidoscopeJIT::ModuleHandleT Module;
+  unsigned Refs;
+};
+
+/// PreparedExprs, PreparedIds - The prepared expressions by id, and the ones
+/// that a prepare of the same key may share by key.
+static std::map<unsigned, PreparedExpr> PreparedExprs;
+static std::map<std::string, unsigned> PreparedIds;
+static unsigned LastPreparedId = 0;
+
+/// NumAnonExprs - The number of top-level expressions compiled so far.
+static unsigned NumAnonExprs = 0;
+
+/// useCache - Whether to look for code compiled before.  Debug info would have
+/// the lines of the first entry, --profile counts each definition anew, and
+/// with --pipeline the code belongs to the back end.
+static bool useCache() {
+  return ExprCacheSize && !EmitDebugInfo && !Profile && !Pipeline;
+}
+
+/// findCachedExpr - Return the cached expression with Key, made the most
+/// recently run, or null.
+static CachedExpr *findCachedExpr(const std::string &Key) {
+  auto It = ExprCacheIndex.find(Key);
+  if (It == ExprCacheIndex.end())
+    return nullptr;
+  ExprCache.splice(ExprCache.begin(), ExprCache, It->second);
+  return &ExprCache.front();
+}
+
+/// cacheExpr - Keep the module H of a top-level expression, whose code is at
+/// Addr, in place of the least recently run one if the cache is full.
+static void cacheExpr(std::string Key, std::set<std::string> Callees,
+                      JITTargetAddress Addr,
+                      KaleidoscopeJIT::ModuleHandleT H) {
+  if (ExprCache.size() >= ExprCacheSize) {
+    TheJIT->removeModule(ExprCache.back().Module);
+    ExprCacheIndex.erase(ExprCache.back().Key);
+    ExprCache.pop_back();
+  }
+  ExprCache.push_front({std::move(Key), std::move(Callees), Addr, H});
+  ExprCacheIndex[ExprCache.front().Key] = ExprCache.begin();
+}
+
+/// invalidateCaches - Forget the code compiled against the declaration of
+/// Name, which is being defined or declared again.  Calls go through stubs,
+/// so the code would still run the new definition, but it may have been
+/// compiled for another prototype, or with the attributes of a host function
+/// Name, like readnone.  (Calls compiled as libm intrinsics cannot be
+/// redefined, see IntrinsicCalls.)
+static void invalidateCaches(const std::string &Name) {
+  for (auto I = ExprCache.begin(); I != ExprCache.end();) {
+    if (I->Callees.count(Name)) {
+      TheJIT->removeModule(I->Module);
+      ExprCacheIndex.erase(I->Key);
+      I = ExprCache.erase(I);
+    } else
+      ++I;
+  }
+  for (auto I = DefinitionSources.begin(); I != DefinitionSources.end();) {
+    if (I->first == Name || I->second.Callees.count(Name))
+      I = DefinitionSources.erase(I);
+    else
+      ++I;
+  }
+  // A prepared expression runs until it is released, so only stop sharing it
+  // with later prepares.
+  for (auto I = PreparedIds.begin(); I != PreparedIds.end();) {
+    if (PreparedExprs[I->second].Callees.count(Name))
+      I = PreparedIds.erase(I);
+    else
+      ++I;
+  }
+}
+
+/// jitDefinition - Compile M, which defines Name under the name BodyName, and
+/// make Name call it.
+static void jitDefinition(std::unique_ptr<Module> M, const std::string &Name,
+                          const std::string &BodyName,
+                          const std::string &Signature) {
+  PhaseTimer Timer(phase_jit);
+  auto Code = TheJIT->addFunction(std::move(M), Name, BodyName);
+  publishFunction(Name, Signature, std::move(Code));
+}
+
+/// jitExpression - Compile M, the module of the top-level expression Name,
+/// setting H to its handle, and return the address of its code.
+static JITTargetAddress jitExpression(std::unique_ptr<Module> M,
+                                      const std::string &Name,
+                                      KaleidoscopeJIT::ModuleHandleT &H) {
+  PhaseTimer JITTimer(phase_jit);
+  H = TheJIT->addModule(std::move(M));
+  JITTimer.stop();
+
+  // Search the JIT for the __anon_expr symbol.
+  PhaseTimer LookupTimer(phase_lookup);
+  auto ExprSymbol = TheJIT->findSymbol(Name);
+  assert(ExprSymbol && "Function not found");
+  return cantFail(ExprSymbol.getAddress());
+}
+
+/// CatchRuntimeErrors - Whether a runtime error of a top-level expression is
+/// reported like a compile error, as Engine::compile does, instead of ending
+/// the process.
+static bool CatchRuntimeErrors = false;
+
+/// RuntimeErrorJump - Where runtimeError returns to on this thread, while
+/// callExpression runs an expression with CatchRuntimeErrors set.
+static thread_local jmp_buf *RuntimeErrorJump = nullptr;
+
+/// RuntimeError - The message of the last runtime error of this thread.
+static thread_local char RuntimeError[128];
+
+/// callExpression - Call FP, setting Result to its value.  Returns false if it
+/// had a runtime error that CatchRuntimeErrors caught.  JIT'd code has nothing
+/// to clean up, so runtimeError may jump over it; this frame has nothing
+/// either.
+static bool callExpression(double (*FP)(), double &Result) {
+  jmp_buf Jump;
+  if (setjmp(Jump)) {
+    RuntimeErrorJump = nullptr;
+    return false;
+  }
+  if (CatchRuntimeErrors)
+    RuntimeErrorJump = &Jump;
+  Result = FP();
+  RuntimeErrorJump = nullptr;
+  return true;
+}
+
+/// runExpression - Run the code of a top-level expression and print its value.
+static void runExpression(JITTargetAddress Addr) {
+  // Cast the address to the right type (takes no arguments, returns a double)
+  // so we can call it as a native function.
+  double (*FP)() = (double (*)())(intptr_t)Addr;
+  double Result;
+  bool Ran;
+  {
+    PhaseTimer ExecuteTimer(phase_execute);
+    Ran = callExpression(FP, Result);
+  }
+  flushOutput();
+  if (!Ran) {
+    LogError(RuntimeError);
+    return;
+  }
+  if (Echo)
+    fprintf(stderr, "Evaluated to %f\n", Result);
+}
+
+//===----------------------------------------------------------------------===//
+// Pipelined driver
+//===----------------------------------------------------------------------===//
+
+// With --pipeline, this thread is the front end: it reads, parses, generates
+// and optimizes the IR of each item, which also sets what the next items are
+// parsed and generated against, like operator precedences and prototypes.
+// The back end thread compiles the modules with the JIT and runs the
+// expressions, one item after another in the order of the input.  Every
+// module has a context of its own, so the two never share IR.
+
+/// WorkItem - An item on its way from the front end to the back end.
+struct WorkItem {
+  enum ItemKind { Definition, Expression, Stop } Kind;
+  /// Output - What the front end printed since the previous item, which the
+  /// back end prints before compiling this one.
+  std::string Output;
+  std::string Name;
+  std::string BodyName;
+  std::string Signature;
+  std::unique_ptr<LLVMContext> Context;
+  std::unique_ptr<Module> M;
+};
+
+/// WorkQueue - The items the back end has not taken yet.  At most MaxItems,
+/// so that the front end cannot get far ahead and keep the IR of many modules.
+class WorkQueue {
+  std::mutex Lock;
+  std::condition_variable Changed;
+  std::deque<WorkItem> Items;
+
+public:
+  enum { MaxItems = 16 };
+
+  void push(WorkItem Item) {
+    std::unique_lock<std::mutex> Guard(Lock);
+    Changed.wait(Guard, [this] { return Items.size() < MaxItems; });
+    Items.push_back(std::move(Item));
+    Changed.notify_all();
+  }
+
+  WorkItem pop() {
+    std::unique_lock<std::mutex> Guard(Lock);
+    Changed.wait(Guard, [this] { return !Items.empty(); });
+    WorkItem Item = std::move(Items.front());
+    Items.pop_front();
+    Changed.notify_all();
+    return Item;
+  }
+};
+
+static WorkQueue TheWorkQueue;
+
+/// BackEndThread - Runs runBackEnd between startPipeline and stopPipeline.
+/// Runtime and fatal errors end the process with _Exit while it is joinable,
+/// so no thread destroys it then.
+static std::thread BackEndThread;
+
+/// PendingOutput - What the front end has printed since the last item it
+/// handed to the back end.
+static std::string PendingOutput;
+static raw_string_ostream PendingStream(PendingOutput);
+
+/// submitItem - Hand the current module, with the item Name in it, to the
+/// back end.  The module, its context and everything printed so far go with
+/// it.  The next module gets a new context.
+static void submitItem(WorkItem::ItemKind Kind, const std::string &Name = "",
+                       const std::string &BodyName = "",
+                       const std::string &Signature = "") {
+  WorkItem Item;
+  Item.Kind = Kind;
+  PendingStream.flush();
+  Item.Output = std::move(PendingOutput);
+  PendingOutput.clear();
+  Item.Name = Name;
+  Item.BodyName = BodyName;
+  Item.Signature = Signature;
+  if (Kind != WorkItem::Stop) {
+    // Free what refers to the context while it still belongs to this thread.
+    DBuilder.reset();
+    TheFPM.reset();
+    Builder.reset();
+    Item.M = std::move(TheModule);
+    Item.Context = std::move(TheContext);
+  }
+  TheWorkQueue.push(std::move(Item));
+}
+
+/// runBackEnd - The back end thread: compile and run the items until Stop.
+static void runBackEnd() {
+  while (true) {
+    WorkItem Item = TheWorkQueue.pop();
+    fputs(Item.Output.c_str(), stderr);
+    switch (Item.Kind) {
+    case WorkItem::Definition:
+      jitDefinition(std::move(Item.M), Item.Name, Item.BodyName,
+                    Item.Signature);
+      break;
+    case WorkItem::Expression: {
+      KaleidoscopeJIT::ModuleHandleT H;
+      runExpression(jitExpression(std::move(Item.M), Item.Name, H));
+      // Delete the anonymous expression module from the JIT.
+      TheJIT->removeModule(H);
+      break;
+    }
+    case WorkItem::Stop:
+      return;
+    }
+  }
+}
+
+/// startPipeline - Start the back end thread.  Call before the first module
+/// is made, so that it is made for FrontEndTM.
+static void startPipeline(const std::string &CPU, const std::string &Features) {
+  FrontEndTM = KaleidoscopeJIT::createTargetMachine(CPU, Features);
+  EchoStream = &PendingStream;
+  BackEndThread = std::thread(runBackEnd);
+}
+
+/// stopPipeline - Wait for the back end to handle every item and stop.
+static void stopPipeline() {
+  submitItem(WorkItem::Stop);
+  BackEndThread.join();
+  EchoStream = nullptr;
+}
+
+/// addDefinition - Hand FnIR, the definition of Name in the current module, to
+/// the JIT, and start a new module.
+static void addDefinition(const std::string &Name, Function *FnIR) {
+  invalidateCaches(Name);
+  std::string Signature = getSignature(*FunctionProtos[Name]);
+  // A recursive body is linked before the stub of Name points at it.
+  TheJIT->declareFunction(Name);
+  // The body gets a name of its own, and Name becomes a stub that the JIT
+  // points at the newest body, so that redefining a function changes what
+  // every caller calls.
+  std::string BodyName = Name + "." + std::to_string(++DefinitionCount[Name]);
+  FnIR->setName(BodyName);
+  finalizeDebugInfo();
+  if (Pipeline)
+    submitItem(WorkItem::Definition, Name, BodyName, Signature);
+  else
+    jitDefinition(std::move(TheModule), Name, BodyName, Signature);
+  InitializeModuleAndPassManager();
+}
+
+/// optimizeProfile - Compile the definition Name again with the counts of its
+/// profile FP, and without counters.
+static void optimizeProfile(const std::string &Name, FunctionProfile &FP) {
+  if (FP.Optimized)
+    return;
+  Function *FnIR;
+  {
+    PhaseTimer Timer(phase_codegen);
+    CurProfile = &FP;
+    ApplyProfile = true;
+    FnIR = FP.AST->codegen();
+    CurProfile = nullptr;
+    ApplyProfile = false;
+  }
+  if (!FnIR)
+    return;
+  FP.Optimized = true;
+  addDefinition(Name, FnIR);
+  fprintf(stderr, "Optimized %s with its profile\n", Name.c_str());
+}
+
+/// optimizeProfiles - Compile every profiled definition again, for
+/// ':profile optimize'.
+static void optimizeProfiles() {
+  for (auto &P : Profiles)
+    optimizeProfile(P.first, *P.second);
+}
+
+/// optimizeHotProfiles - Compile the profiled definitions that have reached
+/// --profile-threshold since the last time again.
+static void optimizeHotProfiles() {
+  std::vector<FunctionProfile *> Hot;
+  {
+    std::lock_guard<std::mutex> Guard(HotProfilesLock);
+    Hot.swap(HotProfiles);
+  }
+  for (FunctionProfile *FP : Hot) {
+    // The code of a definition that has been replaced may still get hot.
+    auto It = Profiles.find(FP->AST->getName());
+    if (It != Profiles.end() && It->second.get() == FP)
+      optimizeProfile(It->first, *FP);
+  }
 }
 
 static void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      TheJIT->addModule(std::move(TheModule));
-      InitializeModuleAndPassManager();
+  beginItem();
+  std::unique_ptr<FunctionAST> FnAST;
+  {
+    PhaseTimer Timer(phase_parse);
+    FnAST = ParseDefinition();
+  }
+
+  if (FnAST) {
+    std::string Name = FnAST->getName();
+    if (SimplifyAST) {
+      PhaseTimer Timer(phase_simplify);
+      FnAST->simplify();
+    }
+
+    // The same definition as the one the function has keeps its code.
+    std::string Key;
+    std::set<std::string> Callees;
+    if (useCache()) {
+      FnAST->appendKey(Key, Callees);
+      auto DS = DefinitionSources.find(Name);
+      if (DS != DefinitionSources.end() && DS->second.Key == Key) {
+        if (Echo)
+          echo() << "Unchanged definition of " << Name << "\n";
+        endItem("definition", Name, true);
+        return;
+      }
+    }
+
+    std::unique_ptr<FunctionProfile> FP;
+    if (Profile)
+      FP = llvm::make_unique<FunctionProfile>();
+    Function *FnIR;
+    {
+      PhaseTimer Timer(phase_codegen);
+      CurProfile = FP.get();
+      FnIR = FnAST->codegen();
+      CurProfile = nullptr;
     }
+    if (FnIR) {
+      if (Echo) {
+        echo() << "Read function definition:";
+        FnIR->print(echo());
+        echo() << "\n";
+      }
+      addDefinition(Name, FnIR);
+      if (!Key.empty())
+        DefinitionSources[Name] = {std::move(Key), std::move(Callees)};
+      if (FP) {
+        auto &Slot = Profiles[Name];
+        if (Slot)
+          OldProfiles.push_back(std::move(Slot));
+        FP->AST = std::move(FnAST);
+        Slot = std::move(FP);
+      }
+    }
+    endItem("definition", Name, FnIR);
   } else {
+    endItem("definition", "", false);
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
 static void HandleExtern() {
-  if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: ");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+  beginItem();
+  std::unique_ptr<PrototypeAST> ProtoAST;
+  {
+    PhaseTimer Timer(phase_parse);
+    ProtoAST = ParseExtern();
+  }
+
+  if (ProtoAST) {
+    std::string Name = ProtoAST->getName();
+    Function *FnIR = nullptr;
+    if (declarePrototype(llvm::make_unique<PrototypeAST>(*ProtoAST))) {
+      PhaseTimer Timer(phase_codegen);
+      FnIR = ProtoAST->codegen();
+    }
+    if (FnIR) {
+      if (Echo) {
+        echo() << "Read extern: ";
+        FnIR->print(echo());
+        echo() << "\n";
+      }
+      invalidateCaches(Name);
+      TheJIT->declareFunction(Name);
     }
+    endItem("extern", Name, FnIR);
   } else {
+    endItem("extern", "", false);
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
 static void HandleTopLevelExpression() {
+  beginItem();
   // Evaluate a top-level expression into an anonymous function.
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (FnAST->codegen()) {
-      // JIT the module containing the anonymous expression, keeping a handle so
-      // we can free it later.
-      auto H = TheJIT->addModule(std::move(TheModule));
-      InitializeModuleAndPassManager();
-
-      // Search the JIT for the __anon_expr symbol.
-      auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
-      assert(ExprSymbol && "Function not found");
-
-      // Get the symbol's address and cast it to the right type (takes no
-      // arguments, returns a double) so we can call it as a native function.
-      double (*FP)() = (double (*)())(intptr_t)cantFail(ExprSymbol.getAddress());
-      fprintf(stderr, "Evaluated to %f\n", FP());
+  std::unique_ptr<FunctionAST> FnAST;
+  {
+    PhaseTimer Timer(phase_parse);
+    FnAST = ParseTopLevelExpr();
+  }
 
-      // Delete the anonymous expression module from the JIT.
-      TheJIT->removeModule(H);
+  if (FnAST) {
+    if (SimplifyAST) {
+      PhaseTimer Timer(phase_simplify);
+      FnAST->simplify();
+    }
+
+    // Run the code of the same expression entered before, if it is cached.
+    std::string Key;
+    std::set<std::string> Callees;
+    CachedExpr *Cached = nullptr;
+    if (useCache()) {
+      FnAST->appendKey(Key, Callees);
+      Cached = findCachedExpr(Key);
+    }
+
+    JITTargetAddress Addr = 0;
+    KaleidoscopeJIT::ModuleHandleT H;
+    if (Cached)
+      Addr = Cached->Address;
+    else {
+      Function *FnIR;
+      {
+        PhaseTimer Timer(phase_codegen);
+        FnIR = FnAST->codegen();
+      }
+      if (FnIR) {
+        // A cached expression keeps its module, so every one needs a name of
+        // its own.
+        std::string Name = "__anon_expr." + std::to_string(++NumAnonExprs);
+        FnIR->setName(Name);
+        finalizeDebugInfo();
+
+        // The back end runs it after the items before it.
+        if (Pipeline) {
+          submitItem(WorkItem::Expression, Name);
+          InitializeModuleAndPassManager();
+          endItem("expression", "__anon_expr", true);
+          return;
+        }
+
+        // JIT the module containing the anonymous expression, keeping a handle
+        // so we can free it later.
+        Addr = jitExpression(std::move(TheModule), Name, H);
+        InitializeModuleAndPassManager();
+      }
+    }
+
+    if (Addr) {
+      runExpression(Addr);
+
+      // Keep the new code for the next time the expression is entered, or
+      // delete the anonymous expression module from the JIT.
+      if (!Cached) {
+        if (!Key.empty())
+          cacheExpr(std::move(Key), std::move(Callees), Addr, H);
+        else
+          TheJIT->removeModule(H);
+      }
+
+      if (Profile && ProfileThreshold)
+        optimizeHotProfiles();
     }
+    endItem("expression", "__anon_expr", Addr != 0);
   } else {
+    endItem("expression", "", false);
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
-/// top ::= definition | external | expression | ';'
+/// skipCommand - Skip the rest of a command that is not run, up to the end of
+/// its line or a ';'.
+static void skipCommand(int Line) {
+  while (CurTok != tok_eof && CurTok != ';' && CurLoc.Line == Line)
+    getNextToken();
+}
+
+/// command ::= ':' 'timing' ('on' | 'off' | 'reset')?
+///         ::= ':' 'profile' 'optimize'?
+/// ':timing on' and ':timing off' turn phase timing on and off, ':timing reset'
+/// forgets the phase times so far, and ':timing' alone prints their summary.
+/// The pass times are kept for the whole session.  ':profile' prints the
+/// counts of --profile, and ':profile optimize' compiles every profiled
+/// definition again with them, without waiting for --profile-threshold.
+static void HandleCommand() {
+  int Line = CurLoc.Line;
+  getNextToken(); // eat ':'.
+  if (Pipeline) {
+    // The back end would be timing and counting while the command runs.
+    LogError("commands cannot be used with --pipeline");
+    skipCommand(Line);
+    return;
+  }
+  if (CurTok == tok_identifier && IdentifierStr == "profile") {
+    getNextToken(); // eat 'profile'.
+    if (CurTok == tok_identifier && IdentifierStr == "optimize") {
+      getNextToken();
+      optimizeProfiles();
+    } else
+      printProfiles();
+    return;
+  }
+  if (CurTok != tok_identifier || IdentifierStr != "timing") {
+    LogError("unknown command, expected :timing or :profile");
+    skipCommand(Line);
+    return;
+  }
+
+  getNextToken(); // eat 'timing'.
+  if (CurTok == tok_identifier && IdentifierStr == "on") {
+    getNextToken();
+    setPhaseTiming(true);
+  } else if (CurTok == tok_identifier && IdentifierStr == "off") {
+    getNextToken();
+    setPhaseTiming(false);
+  } else if (CurTok == tok_identifier && IdentifierStr == "reset") {
+    getNextToken();
+    for (auto &Samples : PhaseSamples)
+      Samples.clear();
+  } else
+    printTimingSummary();
+}
+
+/// top ::= definition | external | expression | command | ';'
 static void MainLoop() {
   while (true) {
-    fprintf(stderr, "ready> ");
+    if (Echo)
+      prompt();
     switch (CurTok) {
     case tok_eof:
       return;
@@ -1203,6 +3952,9 @@ static void MainLoop() {
     case tok_extern:
       HandleExtern();
       break;
+    case ':':
+      HandleCommand();
+      break;
     default:
       HandleTopLevelExpression();
       break;
@@ -1220,23 +3972,224 @@ static void MainLoop() {
 #define DLLEXPORT
 #endif
 
+static cl::opt<std::string>
+    OutputFilename("output",
+                   cl::desc("Write what putchard and printd print to this "
+                            "file instead of standard error"),
+                   cl::value_desc("filename"), cl::init("-"));
+
+static cl::opt<bool>
+    BinaryPrintd("binary-printd",
+                 cl::desc("Make printd write the 8 bytes of the double "
+                          "instead of text"));
+
+/// OutputFile - Where putchard and printd write.
+static FILE *OutputFile = stderr;
+
+/// OutputBuffer - What putchard and printd have printed but not written yet.
+/// Every thread has its own, so printing takes no lock and no system call.
+/// It is written out when it fills up, after each top-level expression, when
+/// the thread exits, and before an error in the thread ends the process.
+/// Only the thread that owns it touches it: another thread cannot tell when
+/// it is safe to write out.
+struct OutputBuffer {
+  char Data[64 * 1024];
+  size_t Size = 0;
+
+  ~OutputBuffer() { flush(); }
+
+  void flush() {
+    if (Size)
+      fwrite(Data, 1, Size, OutputFile);
+    Size = 0;
+  }
+
+  /// reserve - Make room for N bytes and return where they go.
+  char *reserve(size_t N) {
+    if (sizeof(Data) - Size < N)
+      flush();
+    return Data + Size;
+  }
+};
+
+static thread_local OutputBuffer Output;
+
+/// flushOutput - Write out what this thread has printed.  Before an error ends
+/// the process, this is all that is written out: neither exit nor _Exit
+/// destroys the buffers of the other threads, which may be printing, so what
+/// they have not written yet is lost.
+static void flushOutput() {
+  Output.flush();
+  fflush(OutputFile);
+}
+
+/// exitAfterError - End the process after a runtime or fatal error.  While the
+/// --pipeline back end runs, the other thread is still using the static
+/// objects that exit would destroy, so end without destroying them.
+/// Otherwise exit, which runs the atexit handlers of a program that uses
+/// Engine.h.
+[[noreturn]] static void exitAfterError() {
+  if (BackEndThread.joinable())
+    _Exit(1);
+  exit(1);
+}
+
+/// handleFatalError - Print the output before the message of
+/// report_fatal_error, which calls a function that has been declared but not
+/// defined, for example.
+static void handleFatalError(void *, const std::string &Reason, bool) {
+  flushOutput();
+  errs() << "LLVM ERROR: " << Reason << "\n";
+  // End the process here rather than return to report_fatal_error, which
+  // always calls exit.
+  exitAfterError();
+}
+
 /// putchard - putchar that takes a double and returns 0.
 extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
+  *Output.reserve(1) = (char)X;
+  ++Output.Size;
   return 0;
 }
 
 /// printd - printf that takes a double prints it as "%f\n", returning 0.
 extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
+  if (BinaryPrintd) {
+    memcpy(Output.reserve(sizeof(X)), &X, sizeof(X));
+    Output.Size += sizeof(X);
+    return 0;
+  }
+  // "%f" prints at most 309 digits before the point and 6 after it.
+  const size_t MaxLength = 330;
+  Output.Size += snprintf(Output.reserve(MaxLength), MaxLength, "%f\n", X);
   return 0;
 }
 
+//===----------------------------------------------------------------------===//
+// Runtime functions called by generated code.
+//===----------------------------------------------------------------------===//
+
+/// runtimeError - Report a runtime error of JIT'd code, given as for printf,
+/// and end the process.  If callExpression is catching runtime errors, return
+/// to it instead.
+[[noreturn]] static void runtimeError(const char *Format, ...) {
+  va_list Args;
+  va_start(Args, Format);
+  vsnprintf(RuntimeError, sizeof(RuntimeError), Format, Args);
+  va_end(Args);
+  if (RuntimeErrorJump)
+    longjmp(*RuntimeErrorJump, 1);
+  flushOutput();
+  fprintf(stderr, "Error: %s\n", RuntimeError);
+  exitAfterError();
+}
+
+/// kaleidoscope_alloc_array - Allocate the zero-filled data of 'array(n)'.
+extern "C" DLLEXPORT double *kaleidoscope_alloc_array(int64_t N) {
+  double *Data = nullptr;
+  if (N >= 0)
+    Data = (double *)calloc(N ? N : 1, sizeof(double));
+  if (!Data)
+    runtimeError("cannot allocate an array of %lld elements", (long long)N);
+  return Data;
+}
+
+/// kaleidoscope_free_array - Free the data of an array when the function that
+/// allocated it returns.  Data is null if the function did not get as far as
+/// 'array(n)'.
+extern "C" DLLEXPORT void kaleidoscope_free_array(double *Data) { free(Data); }
+
+/// kaleidoscope_bounds_error - Called when an array index is out of bounds.
+extern "C" DLLEXPORT void kaleidoscope_bounds_error(int64_t Index,
+                                                   int64_t Length) {
+  runtimeError("array index %lld is out of bounds [0, %lld)",
+               (long long)Index, (long long)Length);
+}
+
+/// kaleidoscope_index_error - Called when a double array index is not a whole
+/// number in bounds.
+extern "C" DLLEXPORT void kaleidoscope_index_error(double Index,
+                                                  int64_t Length) {
+  if (Index == std::trunc(Index))
+    runtimeError("array index %.0f is out of bounds [0, %lld)", Index,
+                 (long long)Length);
+  runtimeError("array index %g is not a whole number", Index);
+}
+
+/// registerLibraryFunctions - Register the functions above with the JIT, and
+/// the libm functions that getMathIntrinsic has no intrinsic for.  Those read
+/// and write nothing but errno, which Kaleidoscope code cannot see, so they
+/// are pure as far as it is concerned.
+static void registerLibraryFunctions() {
+  // putchard and printd write to the output, so they only promise not to
+  // throw.
+  registerHostFunction("putchard", reinterpret_cast<void *>(putchard),
+                       {type_double}, type_double, {Attribute::NoUnwind});
+  registerHostFunction("printd", reinterpret_cast<void *>(printd),
+                       {type_double}, type_double, {Attribute::NoUnwind});
+  TheJIT->addHostSymbol("kaleidoscope_alloc_array",
+                        getHostAddress(kaleidoscope_alloc_array));
+  TheJIT->addHostSymbol("kaleidoscope_free_array",
+                        getHostAddress(kaleidoscope_free_array));
+  TheJIT->addHostSymbol("kaleidoscope_bounds_error",
+                        getHostAddress(kaleidoscope_bounds_error));
+  TheJIT->addHostSymbol("kaleidoscope_index_error",
+                        getHostAddress(kaleidoscope_index_error));
+
+  static const struct {
+    const char *Name;
+    double (*F)(double);
+  } Unary[] = {{"tan", ::tan},     {"asin", ::asin},   {"acos", ::acos},
+               {"atan", ::atan},   {"sinh", ::sinh},   {"cosh", ::cosh},
+               {"tanh", ::tanh},   {"asinh", ::asinh}, {"acosh", ::acosh},
+               {"atanh", ::atanh}, {"cbrt", ::cbrt},   {"expm1", ::expm1},
+               {"log1p", ::log1p}, {"erf", ::erf},     {"erfc", ::erfc}};
+  for (const auto &Fn : Unary)
+    registerHostFunction(Fn.Name, reinterpret_cast<void *>(Fn.F),
+                         {type_double}, type_double,
+                         {Attribute::ReadNone, Attribute::NoUnwind});
+
+  static const struct {
+    const char *Name;
+    double (*F)(double, double);
+  } Binary[] = {{"atan2", ::atan2}, {"hypot", ::hypot}, {"fmod", ::fmod}};
+  for (const auto &Fn : Binary)
+    registerHostFunction(Fn.Name, reinterpret_cast<void *>(Fn.F),
+                         {type_double, type_double}, type_double,
+                         {Attribute::ReadNone, Attribute::NoUnwind});
+}
+
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main() {
+static cl::opt<std::string>
+    JITCPU("jit-cpu",
+           cl::desc("Generate code for this CPU instead of the host CPU, "
+                    "e.g. x86-64 for code that runs on any x86-64"),
+           cl::value_desc("cpu"));
+
+static cl::opt<std::string>
+    JITFeatures("jit-features",
+                cl::desc("Turn CPU features on or off, e.g. +fma,-avx512f"),
+                cl::value_desc("features"));
+
+static cl::list<std::string>
+    LoadLibraries("load",
+                  cl::desc("Load a shared library whose functions can be "
+                           "extern'd"),
+                  cl::value_desc("library"));
+
+#ifndef LLVM_ON_WIN32
+static cl::opt<bool>
+    PerfMap("perf-map",
+            cl::desc("Write /tmp/perf-PID.map so that perf can name JIT'd "
+                     "functions"));
+#endif
+
+/// initializeCompiler - Set up the native target, the standard binary
+/// operators and the JIT with the library functions.
+static void initializeCompiler() {
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
@@ -1249,16 +4202,347 @@ int main() {
   BinopPrecedence['-'] = 20;
   BinopPrecedence['*'] = 40; // highest.
 
+  TheJIT = llvm::make_unique<KaleidoscopeJIT>(JITCPU, JITFeatures);
+  registerLibraryFunctions();
+  install_fatal_error_handler(handleFatalError);
+}
+
+// libkaleido is this file without main(), for programs that use Engine.h.
+#ifndef KALEIDO_LIBRARY
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
+  // Read the named file instead of standard input.
+  if (InputFilename != "-" && !freopen(InputFilename.c_str(), "r", stdin)) {
+    fprintf(stderr, "Error: cannot open %s\n", InputFilename.c_str());
+    return 1;
+  }
+  if (OutputFilename != "-") {
+    OutputFile = fopen(OutputFilename.c_str(), "wb");
+    if (!OutputFile) {
+      fprintf(stderr, "Error: cannot open %s\n", OutputFilename.c_str());
+      return 1;
+    }
+  }
+
+  if (Pipeline && (Profile || TimePhases)) {
+    fprintf(stderr, "Error: --pipeline cannot be used with --profile or "
+                    "--time-phases\n");
+    return 1;
+  }
+
+  initializeCompiler();
+  for (const auto &Path : LoadLibraries) {
+    std::string ErrMsg;
+    if (!TheJIT->loadLibrary(Path, ErrMsg)) {
+      fprintf(stderr, "Error: cannot load %s: %s\n", Path.c_str(),
+              ErrMsg.c_str());
+      return 1;
+    }
+  }
+  // Register the code with GDB's JIT interface, so that breakpoints and
+  // backtraces work in JIT'd functions.
+  if (EmitDebugInfo)
+    TheJIT->addEventListener(JITEventListener::createGDBRegistrationListener());
+#ifndef LLVM_ON_WIN32
+  if (PerfMap) {
+    // The map cannot forget freed code, so the objects need not be kept.
+    static PerfMapListener PerfMapWriter;
+    TheJIT->addEventListener(&PerfMapWriter, /*NotifyFreeing=*/false);
+  }
+#endif
+  if (Pipeline)
+    startPipeline(JITCPU, JITFeatures);
+
   // Prime the first token.
-  fprintf(stderr, "ready> ");
+  prompt();
   getNextToken();
 
-  TheJIT = llvm::make_unique<KaleidoscopeJIT>();
-
   InitializeModuleAndPassManager();
 
+  // Time the passes as well with --time-phases.
+  setPhaseTiming(TimePhases);
+
   // Run the main "interpreter loop" now.
   MainLoop();
+  if (Pipeline)
+    stopPipeline();
+
+  flushOutput();
+
+  if (TimePhases)
+    printTimingSummary();
+  // Keep LLVM from printing its own report of the pass timers at exit.
+  setPhaseTiming(false);
+  TimerGroup::clearAll();
 
   return 0;
-}
\ No newline at end of file
+}
+#endif
+
+//===----------------------------------------------------------------------===//
+// Embedding API, see Engine.h.
+//===----------------------------------------------------------------------===//
+
+/// beginSource - Make the lexer read Source and LogError report to Errors,
+/// until endSource.
+static void beginSource(const char *Source, size_t Length,
+                        std::string &Errors) {
+  ReadingSource = true;
+  SourceCur = Source;
+  SourceEnd = Source + Length;
+  LexLoc = {1, 0};
+  ErrorLog = &Errors;
+}
+
+static void endSource() {
+  ErrorLog = nullptr;
+  ReadingSource = false;
+  SourceCur = SourceEnd = nullptr;
+}
+
+/// getValueType - The type that a TypeCode letter of Engine.h stands for.
+static ValueType getValueType(char Code) {
+  switch (Code) {
+  case 'i':
+    return type_int;
+  case 'b':
+    return type_bool;
+  case 'p':
+    return type_array;
+  default:
+    return type_double;
+  }
+}
+
+/// parseSignature - Set RetType and ArgTypes to the types of a signature of
+/// Engine.h, which has "pi" for an array and a letter for any other type.
+/// Returns false if it has a letter for no type, or returns an array.
+static bool parseSignature(const char *Signature, ValueType &RetType,
+                           std::vector<ValueType> &ArgTypes) {
+  if (!*Signature || !strchr("dibp", *Signature))
+    return false;
+  RetType = getValueType(Signature[0]);
+  for (const char *C = Signature + 1; *C; ++C) {
+    if (!strchr("dibp", *C))
+      return false;
+    ArgTypes.push_back(getValueType(*C));
+    if (*C == 'p' && *++C != 'i')
+      return false;
+  }
+  return RetType != type_array;
+}
+
+kaleido::Engine::Engine() {
+  assert(!TheJIT && "There can be only one Engine");
+  Echo = false;
+  CatchRuntimeErrors = true;
+  initializeCompiler();
+  InitializeModuleAndPassManager();
+}
+
+kaleido::Engine::~Engine() {
+  flushOutput();
+
+  // Drop the code first, since each reference to it removes its module from
+  // the JIT.  Then forget everything that was defined, so that the next
+  // Engine starts like this one did.
+  PreparedIds.clear();
+  PreparedExprs.clear();
+  ExprCacheIndex.clear();
+  ExprCache.clear();
+  DefinitionSources.clear();
+  DefinitionCode.clear();
+  TheFunctions.clear();
+  ShareFunctions = false;
+  TheJIT.reset();
+
+  HotProfiles.clear();
+  OldProfiles.clear();
+  Profiles.clear();
+  HostFunctions.clear();
+  DefinitionCount.clear();
+  IntrinsicCalls.clear();
+  FunctionProtos.clear();
+  BinopPrecedence.clear();
+  NamedValues.clear();
+  NumAnonExprs = 0;
+  LastPreparedId = 0;
+
+  DBuilder.reset();
+  TheFPM.reset();
+  TheModule.reset();
+  Builder.reset();
+  TheContext.reset();
+  remove_fatal_error_handler();
+  CatchRuntimeErrors = false;
+}
+
+bool kaleido::Engine::compile(const char *Source, size_t Length) {
+  std::string Errors;
+  beginSource(Source, Length, Errors);
+  getNextToken();
+  MainLoop();
+  endSource();
+  Error = std::move(Errors);
+  return Error.empty();
+}
+
+uint64_t kaleido::Engine::lookup(const std::string &Name,
+                                 const char *Signature) {
+  auto FI = FunctionProtos.find(Name);
+  if (FI == FunctionProtos.end()) {
+    Error = "Error: " + Name + " is not defined\n";
+    return 0;
+  }
+  if (getSignature(*FI->second) != Signature) {
+    Error = "Error: " + Name + " does not have the requested signature\n";
+    return 0;
+  }
+  auto Sym = TheJIT->findSymbol(Name);
+  if (!Sym) {
+    if (auto Err = Sym.takeError())
+      consumeError(std::move(Err));
+    Error = "Error: " + Name + " is declared but not defined\n";
+    return 0;
+  }
+  return cantFail(Sym.getAddress());
+}
+
+uint64_t kaleido::Engine::prepareExpr(const std::string &Expr,
+                                      const std::vector<std::string> &Params,
+                                      const char *Signature, unsigned &Id) {
+  ValueType RetType;
+  std::vector<ValueType> ArgTypes;
+  if (!parseSignature(Signature, RetType, ArgTypes) ||
+      ArgTypes.size() != Params.size()) {
+    Error = "Error: the signature does not match the parameters\n";
+    return 0;
+  }
+
+  std::string Errors;
+  beginSource(Expr.data(), Expr.size(), Errors);
+  getNextToken();
+  SourceLocation Loc = CurLoc;
+  std::unique_ptr<ExprAST> Body = ParseExpression();
+  if (Body && CurTok != tok_eof)
+    Body = LogError("Expected the end of the expression");
+  while (CurTok != tok_eof)
+    getNextToken();
+  if (!Body) {
+    endSource();
+    Error = std::move(Errors);
+    return 0;
+  }
+
+  // Share the code of the same expression, as parsed against the operators
+  // there are now, unless a function it calls has been defined since.
+  std::string Key = std::string(Signature) + "(";
+  for (const auto &Param : Params)
+    Key += Param + ",";
+  Key += ")";
+  std::set<std::string> Callees;
+  Body->appendKey(Key, Callees);
+  auto IdIt = PreparedIds.find(Key);
+  if (IdIt != PreparedIds.end()) {
+    endSource();
+    PreparedExpr &PE = PreparedExprs[IdIt->second];
+    ++PE.Refs;
+    Id = IdIt->second;
+    return PE.Address;
+  }
+
+  // The name cannot be called from Kaleidoscope, which has no '.' in names.
+  std::string Name = "__prepared." + std::to_string(++LastPreparedId);
+  FunctionAST FnAST(llvm::make_unique<PrototypeAST>(Loc, Name, Params, false,
+                                                    0, ArgTypes, RetType),
+                    std::move(Body));
+  if (SimplifyAST)
+    FnAST.simplify();
+  Function *FnIR = FnAST.codegen();
+  FunctionProtos.erase(Name);
+  endSource();
+  if (!FnIR) {
+    Error = std::move(Errors);
+    return 0;
+  }
+
+  finalizeDebugInfo();
+  auto H = TheJIT->addModule(std::move(TheModule));
+  InitializeModuleAndPassManager();
+  auto Sym = TheJIT->findSymbol(Name);
+  assert(Sym && "Function not found");
+
+  PreparedExprs[LastPreparedId] = {Key, std::move(Callees),
+                                   cantFail(Sym.getAddress()), H, 1};
+  PreparedIds[Key] = Id = LastPreparedId;
+  return PreparedExprs[Id].Address;
+}
+
+void kaleido::Engine::releaseExpr(unsigned Id) {
+  auto It = PreparedExprs.find(Id);
+  if (It == PreparedExprs.end() || --It->second.Refs)
+    return;
+  TheJIT->removeModule(It->second.Module);
+  // A later prepare of the same key may have its own code by now.
+  auto IdIt = PreparedIds.find(It->second.Key);
+  if (IdIt != PreparedIds.end() && IdIt->second == Id)
+    PreparedIds.erase(IdIt);
+  PreparedExprs.erase(It);
+}
+
+bool kaleido::Engine::registerFunction(const std::string &Name, void *Address,
+                                       const char *Signature, unsigned Attrs) {
+  ValueType RetType;
+  std::vector<ValueType> ArgTypes;
+  if (!parseSignature(Signature, RetType, ArgTypes)) {
+    Error = "Error: " + Name + " does not have a Kaleidoscope signature\n";
+    return false;
+  }
+
+  std::vector<Attribute::AttrKind> Kinds;
+  if (Attrs & NoUnwind)
+    Kinds.push_back(Attribute::NoUnwind);
+  if ((Attrs & ReadNone) == ReadNone)
+    Kinds.push_back(Attribute::ReadNone);
+  else if ((Attrs & ReadOnly) == ReadOnly)
+    Kinds.push_back(Attribute::ReadOnly);
+  if (Attrs & Cold)
+    Kinds.push_back(Attribute::Cold);
+  registerHostFunction(Name, Address, std::move(ArgTypes), RetType,
+                       std::move(Kinds));
+  return true;
+}
+
+void kaleido::Engine::shareFunctions() {
+  if (ShareFunctions)
+    return;
+  ShareFunctions = true;
+  for (auto &Definition : DefinitionCode)
+    publishFunction(Definition.first,
+                    getSignature(*FunctionProtos[Definition.first]),
+                    std::move(Definition.second));
+  DefinitionCode.clear();
+}
+
+kaleido::Snapshot kaleido::Engine::snapshot() const {
+  Snapshot S;
+  S.Table = TheFunctions.snapshot();
+  return S;
+}
+
+uint64_t kaleido::Snapshot::lookup(const std::string &Name,
+                                   const char *Signature) const {
+  if (!Table)
+    return 0;
+  const auto &Functions =
+      static_cast<const FunctionTable::Version *>(Table.get())->Functions;
+  auto It = Functions.find(Name);
+  if (It == Functions.end() || It->second.Signature != Signature)
+    return 0;
+  return It->second.Address;
+}
+
+size_t kaleido::Engine::getPreparedCount() const {
+  return PreparedExprs.size();
+}
@@ -16,43 +16,382 @@
 
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/SymbolSize.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
+#ifndef LLVM_ON_WIN32
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace llvm {
 namespace orc {
 
+#ifndef LLVM_ON_WIN32
+/// PerfMapListener - Appends the address, size and name of every function in
+/// the objects the JIT loads to /tmp/perf-PID.map, where Linux perf looks for
+/// the names of code that is not in any file.
+class PerfMapListener : public JITEventListener {
+public:
+  PerfMapListener() {
+    std::error_code EC;
+    std::string Path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    Map = llvm::make_unique<raw_fd_ostream>(Path, EC, sys::fs::F_Text);
+    if (EC) {
+      errs() << "Cannot open " << Path << ": " << EC.message() << "\n";
+      Map.reset();
+    }
+  }
+
+  void NotifyObjectEmitted(const object::ObjectFile &Obj,
+                           const RuntimeDyld::LoadedObjectInfo &L) override {
+    if (!Map)
+      return;
+
+    // The debug object has the addresses the sections were loaded at.
+    object::OwningBinary<object::ObjectFile> DebugObj =
+        L.getObjectForDebug(Obj);
+    if (!DebugObj.getBinary())
+      return;
+
+    for (const auto &P : object::computeSymbolSizes(*DebugObj.getBinary())) {
+      object::SymbolRef Sym = P.first;
+      Expected<object::SymbolRef::Type> Type = Sym.getType();
+      if (!Type) {
+        consumeError(Type.takeError());
+        continue;
+      }
+      if (*Type != object::SymbolRef::ST_Function || P.second == 0)
+        continue;
+      Expected<StringRef> Name = Sym.getName();
+      Expected<uint64_t> Addr = Sym.getAddress();
+      if (!Name || !Addr) {
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        continue;
+      }
+      *Map << format("%llx %llx ", (unsigned long long)*Addr,
+                     (unsigned long long)P.second)
+           << *Name << '\n';
+    }
+    // perf may read the map while we are still running.
+    Map->flush();
+  }
+
+  // The map has no way to say that code went away, so the entries of freed
+  // code stay.  Samples in memory that is reused by a later module may be
+  // reported under the older name.
+
+private:
+  std::unique_ptr<raw_fd_ostream> Map;
+};
+#endif
+
+/// FunctionTable - The addresses of JIT'd functions by name, for threads that
+/// call them while another thread keeps adding definitions.
+///
+/// The table is published read-copy-update style.  A reader takes a snapshot,
+/// an immutable version of the table that it can use without any lock.  A
+/// writer copies the current version, changes the copy and publishes it with
+/// one atomic store, so readers never wait for writers.  A reader must hold a
+/// snapshot while it runs the functions in it.  Calls go through stubs, so
+/// they may reach a body that was published after the snapshot was taken.
+/// Each version therefore keeps the versions published after it, and the
+/// entries keep their code loaded: the body of a replaced function is freed
+/// once no snapshot from before the replacement is left.
+class FunctionTable {
+public:
+  /// Entry - A function at Address whose code Code keeps loaded.  Signature
+  /// has a letter for its return type and then one for each argument type.
+  struct Entry {
+    JITTargetAddress Address;
+    std::string Signature;
+    std::shared_ptr<const void> Code;
+  };
+
+  /// Version - The table as one publish left it, and the version that
+  /// replaced it.
+  struct Version {
+    std::map<std::string, Entry> Functions;
+    mutable std::shared_ptr<const Version> Next;
+
+    ~Version() {
+      // Free the versions after this one that nothing else holds in a loop
+      // rather than by recursing once for each.
+      std::shared_ptr<const Version> Later = std::move(Next);
+      while (Later && Later.use_count() == 1)
+        Later = std::move(Later->Next);
+    }
+  };
+  using Snapshot = std::shared_ptr<const Version>;
+
+  FunctionTable() : Current(std::make_shared<Version>()) {}
+
+  Snapshot snapshot() const { return std::atomic_load(&Current); }
+
+  /// publish - Make Name refer to E in the snapshots taken from now on.  A
+  /// snapshot taken before keeps the old entry.
+  void publish(const std::string &Name, Entry E) {
+    std::lock_guard<std::mutex> Guard(WriteLock);
+    auto Next = std::make_shared<Version>();
+    Next->Functions = Current->Functions;
+    Next->Functions[Name] = std::move(E);
+    Current->Next = Next;
+    std::atomic_store(&Current, Snapshot(std::move(Next)));
+  }
+
+  /// clear - Publish a table with no functions.
+  void clear() {
+    std::lock_guard<std::mutex> Guard(WriteLock);
+    auto Next = std::make_shared<Version>();
+    Current->Next = Next;
+    std::atomic_store(&Current, Snapshot(std::move(Next)));
+  }
+
+private:
+  Snapshot Current;
+  std::mutex WriteLock;
+};
+
+#ifndef LLVM_ON_WIN32
+/// NearMemoryMapper - Hands SectionMemoryManager pages from one region of Size
+/// bytes that is reserved up front, so that all the code and data the JIT loads
+/// is within 2GB of each other.  Code built with the small code model can then
+/// reach its constant pools and the functions of its own module with 32 bit PC
+/// relative offsets.  Code is taken from the bottom of the region and data from
+/// the top, so that code stays together.  Freed pages are made inaccessible
+/// again, their memory goes back to the system, and they are reused first fit.
+/// If the region is full, or cannot be reserved, pages are mapped as close to
+/// it as the system allows, which may be out of reach.  It is only used under
+/// the lock of the JIT.
+class NearMemoryMapper : public SectionMemoryManager::MemoryMapper {
+public:
+  explicit NearMemoryMapper(size_t Size = size_t(1) << 30) {
+    // Pages that no one may access only reserve the addresses.
+    void *Addr = ::mmap(nullptr, Size, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (Addr == MAP_FAILED) {
+      errs() << "Cannot reserve memory for the JIT: " << std::strerror(errno)
+             << "\n";
+      return;
+    }
+    Begin = static_cast<char *>(Addr);
+    End = Begin + Size;
+    Free[Begin] = Size;
+  }
+
+  ~NearMemoryMapper() override {
+    if (Begin)
+      ::munmap(Begin, End - Begin);
+  }
+
+  sys::MemoryBlock
+  allocateMappedMemory(SectionMemoryManager::AllocationPurpose Purpose,
+                       size_t NumBytes, const sys::MemoryBlock *const NearBlock,
+                       unsigned Flags, std::error_code &EC) override {
+    size_t Size = alignTo(NumBytes, sys::Process::getPageSize());
+    bool IsCode = Purpose == SectionMemoryManager::AllocationPurpose::Code;
+    if (char *Addr = take(Size, /*FromTop=*/!IsCode)) {
+      sys::MemoryBlock Block(Addr, Size);
+      EC = sys::Memory::protectMappedMemory(Block, Flags);
+      if (EC) {
+        releaseMappedMemory(Block);
+        return sys::MemoryBlock();
+      }
+      return Block;
+    }
+
+    // Map the pages right after NearBlock if it is outside the region, or
+    // else right after the region.
+    sys::MemoryBlock Region(Begin, End - Begin);
+    const sys::MemoryBlock *Hint = &Region;
+    if (NearBlock && NearBlock->base() && !contains(NearBlock->base()))
+      Hint = NearBlock;
+    return sys::Memory::allocateMappedMemory(Size, Hint, Flags, EC);
+  }
+
+  std::error_code protectMappedMemory(const sys::MemoryBlock &Block,
+                                      unsigned Flags) override {
+    return sys::Memory::protectMappedMemory(Block, Flags);
+  }
+
+  std::error_code releaseMappedMemory(sys::MemoryBlock &M) override {
+    char *Addr = static_cast<char *>(M.base());
+    if (!contains(Addr))
+      return sys::Memory::releaseMappedMemory(M);
+    size_t Size = M.size();
+    M = sys::MemoryBlock();
+
+    // Replace the pages with new ones that no one may access, which frees
+    // their memory.
+    if (::mmap(Addr, Size, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+               0) == MAP_FAILED)
+      return std::error_code(errno, std::generic_category());
+
+    // Merge the pages with the free ranges right after and right before them.
+    auto Next = Free.lower_bound(Addr);
+    if (Next != Free.end() && Addr + Size == Next->first) {
+      Size += Next->second;
+      Next = Free.erase(Next);
+    }
+    if (Next != Free.begin()) {
+      auto Prev = std::prev(Next);
+      if (Prev->first + Prev->second == Addr) {
+        Prev->second += Size;
+        return std::error_code();
+      }
+    }
+    Free[Addr] = Size;
+    return std::error_code();
+  }
+
+private:
+  bool contains(const void *Addr) const {
+    return Addr >= Begin && Addr < End;
+  }
+
+  /// take - Remove Size bytes from the lowest free range they fit in, or from
+  /// the highest if FromTop is set, and return where they are.  Returns null
+  /// if they fit nowhere.
+  char *take(size_t Size, bool FromTop) {
+    if (FromTop) {
+      for (auto I = Free.rbegin(), E = Free.rend(); I != E; ++I) {
+        if (I->second < Size)
+          continue;
+        I->second -= Size;
+        char *Addr = I->first + I->second;
+        if (!I->second)
+          Free.erase(std::next(I).base());
+        return Addr;
+      }
+      return nullptr;
+    }
+    for (auto I = Free.begin(), E = Free.end(); I != E; ++I) {
+      if (I->second < Size)
+        continue;
+      char *Addr = I->first;
+      size_t Rest = I->second - Size;
+      Free.erase(I);
+      if (Rest)
+        Free[Addr + Size] = Rest;
+      return Addr;
+    }
+    return nullptr;
+  }
+
+  char *Begin = nullptr;
+  char *End = nullptr;
+  std::map<char *, size_t> Free;
+};
+#endif
+
+/// KaleidoscopeJIT - Compiles modules and finds the symbols in them.  Every
+/// public method may be called from any thread.  The layers below are not
+/// thread safe, so they are used under one lock, which also covers linking
+/// a module the first time one of its symbols is looked up.
 class KaleidoscopeJIT {
 public:
   using ObjLayerT = RTDyldObjectLinkingLayer;
   using CompileLayerT = IRCompileLayer<ObjLayerT, SimpleCompiler>;
   using ModuleHandleT = CompileLayerT::ModuleHandleT;
 
-  KaleidoscopeJIT()
-      : TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
-        ObjectLayer([]() { return std::make_shared<SectionMemoryManager>(); }),
-        CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
+  /// CodeRef - Keeps the module of a function body loaded.  When the last
+  /// CodeRef to it goes away the module is removed, so none may outlive the
+  /// JIT.
+  using CodeRef = std::shared_ptr<const void>;
+
+  /// The JIT generates code for CPU, or for the host CPU with every feature
+  /// it has if CPU is empty.  Features, like "+fma,-avx512f", turns features
+  /// on or off after that.
+  explicit KaleidoscopeJIT(const std::string &CPU = "",
+                           const std::string &Features = "")
+      : TM(selectTarget(CPU, Features)), DL(TM->createDataLayout()),
+        NearMemory(usesNearCode(TM->getTargetTriple()) ? createNearMemory()
+                                                       : nullptr),
+        ObjectLayer([this]() {
+                      return std::make_shared<SectionMemoryManager>(
+                          NearMemory.get());
+                    },
+                    [this](ObjLayerT::ObjHandleT H,
+                           const ObjLayerT::ObjectPtr &Obj,
+                           const RuntimeDyld::LoadedObjectInfo &Info) {
+                      notifyObjectLoaded(H, Obj, Info);
+                    }),
+        CompileLayer(ObjectLayer, SimpleCompiler(*TM)),
+        StubsMgr(createLocalIndirectStubsManagerBuilder(
+            TM->getTargetTriple())()) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  /// createTargetMachine - Return a new TargetMachine for the target that a
+  /// JIT made with CPU and Features compiles for, for a thread that generates
+  /// IR while the JIT compiles.  A TargetMachine cannot be shared between
+  /// threads, since it keeps the subtarget of every function it is asked about.
+  static std::unique_ptr<TargetMachine>
+  createTargetMachine(const std::string &CPU, const std::string &Features) {
+    return std::unique_ptr<TargetMachine>(selectTarget(CPU, Features));
+  }
+
+  /// addEventListener - Tell L about every object the JIT loads from now on.
+  /// If NotifyFreeing is set L is also told about freeing it when its module
+  /// is removed, for which the JIT keeps every loaded object.  L must outlive
+  /// the JIT.
+  void addEventListener(JITEventListener *L, bool NotifyFreeing = true) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    EventListeners.push_back(L);
+    if (NotifyFreeing)
+      FreeingListeners.push_back(L);
+  }
+
   ModuleHandleT addModule(std::unique_ptr<Module> M) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+
+    // Call the functions of other modules and of the host through the GOT,
+    // with one indirect call, instead of through a PLT stub.
+    if (NearMemory)
+      for (Function &F : *M)
+        if (F.isDeclaration() && !F.isIntrinsic())
+          F.addFnAttr(Attribute::NonLazyBind);
+
     // We need a memory manager to allocate memory and resolve symbols for this
     // new module. Create one that resolves symbols by looking back into the
     // JIT.
@@ -60,7 +399,17 @@ public:
         [&](const std::string &Name) {
           if (auto Sym = findMangledSymbol(Name))
             return Sym;
-          return JITSymbol(nullptr);
+          // A function that is declared but not defined yet gets a stub now,
+          // which a later addFunction points at the definition.  Any other
+          // name is left unresolved, and RuntimeDyld reports it.
+          auto Declared = DeclaredFunctions.find(Name);
+          if (Declared == DeclaredFunctions.end())
+            return JITSymbol(nullptr);
+          cantFail(StubsMgr->createStub(
+              Name, addUndefinedFunction(Declared->second),
+              JITSymbolFlags::Exported));
+          UndefinedStubs.insert(Name);
+          return StubsMgr->findStub(Name, false);
         },
         [](const std::string &S) { return nullptr; });
     auto H = cantFail(CompileLayer.addModule(std::move(M),
@@ -70,16 +419,196 @@ public:
     return H;
   }
 
+  /// addFunction - Add M, which defines the function Name under the name
+  /// BodyName, and point the stub Name at that body.  JIT'd code calls Name
+  /// through the stub, so a later addFunction of the same Name takes over
+  /// every caller at once, even threads that are running.  The returned
+  /// CodeRef must be kept until no thread can be running the body any more.
+  CodeRef addFunction(std::unique_ptr<Module> M, const std::string &Name,
+                      const std::string &BodyName) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    auto H = addModule(std::move(M));
+    auto Body = CompileLayer.findSymbolIn(H, mangle(BodyName), false);
+    assert(Body && "Function body not found");
+    JITTargetAddress BodyAddr = cantFail(Body.getAddress());
+
+    std::string StubName = mangle(Name);
+    UndefinedStubs.erase(StubName);
+    if (StubsMgr->findStub(StubName, false))
+      cantFail(StubsMgr->updatePointer(StubName, BodyAddr));
+    else
+      cantFail(StubsMgr->createStub(StubName, BodyAddr,
+                                    JITSymbolFlags::Exported));
+
+    return CodeRef(nullptr, [this, H](const void *) { removeModule(H); });
+  }
+
+  /// declareFunction - Let modules call Name before it is defined.  Until
+  /// addFunction defines it, or a library loaded later has it, calling it is a
+  /// fatal error that names it.
+  void declareFunction(const std::string &Name) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    DeclaredFunctions[mangle(Name)] = Name;
+  }
+
+  /// addHostSymbol - Resolve Name to Addr, a function or variable of the host,
+  /// without searching the process for it.
+  void addHostSymbol(const std::string &Name, JITTargetAddress Addr) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    std::string MangledName = mangle(Name);
+    HostSymbols[MangledName] = Addr;
+    if (UndefinedStubs.erase(MangledName))
+      cantFail(StubsMgr->updatePointer(MangledName, Addr));
+  }
+
+  /// loadLibrary - Make the symbols of the shared library at Path visible to
+  /// JIT'd code.  Returns false and sets ErrMsg if it cannot be loaded.
+  bool loadLibrary(const std::string &Path, std::string &ErrMsg) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    if (sys::DynamicLibrary::LoadLibraryPermanently(Path.c_str(), &ErrMsg))
+      return false;
+
+    // The library may have symbols that were not found before.  The ones that
+    // were found stay the same, since the libraries loaded earlier are
+    // searched first.
+    for (auto I = HostSymbols.begin(); I != HostSymbols.end();) {
+      if (I->second)
+        ++I;
+      else
+        I = HostSymbols.erase(I);
+    }
+
+    // Point the stubs of functions that were declared but never defined at
+    // the library's definitions.
+    for (auto I = UndefinedStubs.begin(); I != UndefinedStubs.end();) {
+      if (JITTargetAddress Addr = findHostSymbol(*I)) {
+        cantFail(StubsMgr->updatePointer(*I, Addr));
+        I = UndefinedStubs.erase(I);
+      } else
+        ++I;
+    }
+    return true;
+  }
+
   void removeModule(ModuleHandleT H) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
     ModuleHandles.erase(find(ModuleHandles, H));
+
+    // Tell the listeners while the code is still there.  A module that was
+    // never looked up was never loaded, so it has nothing to free.
+    auto Loaded = find_if(LoadedObjects, [&](const LoadedObject &O) {
+      return O.first == H;
+    });
+    if (Loaded != LoadedObjects.end()) {
+      for (auto *L : FreeingListeners)
+        L->NotifyFreeingObject(*Loaded->second->getBinary());
+      LoadedObjects.erase(Loaded);
+    }
+
     cantFail(CompileLayer.removeModule(H));
   }
 
+  /// findSymbol - Return the newest definition of Name, already linked.  The
+  /// symbol is resolved here rather than on the caller's getAddress, which
+  /// would link the module outside the lock.
   JITSymbol findSymbol(const std::string Name) {
-    return findMangledSymbol(mangle(Name));
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    auto Sym = findMangledSymbol(mangle(Name));
+    if (!Sym)
+      return Sym;
+    auto Addr = Sym.getAddress();
+    if (!Addr)
+      return Addr.takeError();
+    return JITSymbol(*Addr, Sym.getFlags());
   }
 
 private:
+  using LoadedObject = std::pair<ObjLayerT::ObjHandleT, ObjLayerT::ObjectPtr>;
+
+  static TargetMachine *selectTarget(const std::string &CPU,
+                                     const std::string &Features) {
+    std::string Name = CPU;
+    SmallVector<std::string, 64> Attrs;
+    if (Name.empty()) {
+      Name = sys::getHostCPUName().str();
+      StringMap<bool> HostFeatures;
+      if (sys::getHostCPUFeatures(HostFeatures))
+        for (auto &F : HostFeatures)
+          Attrs.push_back((F.second ? "+" : "-") + F.first().str());
+    }
+    SmallVector<StringRef, 8> Extra;
+    StringRef(Features).split(Extra, ',', -1, false);
+    for (StringRef F : Extra)
+      Attrs.push_back(F.str());
+
+    EngineBuilder Builder;
+    Builder.setMCPU(Name).setMAttrs(Attrs);
+    if (usesNearCode(Triple(sys::getProcessTriple())))
+      Builder.setCodeModel(CodeModel::Small).setRelocationModel(Reloc::PIC_);
+    return Builder.selectTarget();
+  }
+
+  static std::unique_ptr<SectionMemoryManager::MemoryMapper>
+  createNearMemory() {
+#ifndef LLVM_ON_WIN32
+    return llvm::make_unique<NearMemoryMapper>();
+#else
+    return nullptr;
+#endif
+  }
+
+  /// usesNearCode - Whether the JIT puts all its code in one NearMemoryMapper
+  /// region and generates it with the small code model instead of the large
+  /// one, which loads every address into a register.  Code that is position
+  /// independent calls functions through the PLT, for which RuntimeDyld adds
+  /// a stub when the function is not in the same object, so calls into the
+  /// host process still reach.  Only ELF and MachO on x86-64 get such stubs.
+  static bool usesNearCode(const Triple &TT) {
+    return TT.getArch() == Triple::x86_64 && !TT.isOSWindows();
+  }
+
+  void notifyObjectLoaded(ObjLayerT::ObjHandleT H,
+                          const ObjLayerT::ObjectPtr &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &Info) {
+    if (EventListeners.empty())
+      return;
+    for (auto *L : EventListeners)
+      L->NotifyObjectEmitted(*Obj->getBinary(), Info);
+    // Keep the object so that the listeners can be told when it is freed.
+    if (!FreeingListeners.empty())
+      LoadedObjects.push_back(std::make_pair(H, Obj));
+  }
+
+  static void undefinedFunction(const char *Name) {
+    report_fatal_error(Twine("called ") + Name +
+                       ", which has been declared but not defined");
+  }
+
+  /// addUndefinedFunction - Add code that calls undefinedFunction with Name,
+  /// for the stub of Name until it is defined, and return its address.
+  JITTargetAddress addUndefinedFunction(const std::string &Name) {
+    std::string FnName = "__undefined." + Name;
+    auto M = llvm::make_unique<Module>(FnName, UndefinedContext);
+    M->setDataLayout(DL);
+    Function *F = Function::Create(
+        FunctionType::get(Type::getVoidTy(UndefinedContext), false),
+        Function::ExternalLinkage, FnName, M.get());
+    IRBuilder<> B(BasicBlock::Create(UndefinedContext, "entry", F));
+    FunctionType *ReportTy =
+        FunctionType::get(B.getVoidTy(), B.getInt8PtrTy(), false);
+    Constant *Report = ConstantExpr::getIntToPtr(
+        ConstantInt::get(DL.getIntPtrType(UndefinedContext),
+                         reinterpret_cast<uintptr_t>(&undefinedFunction)),
+        ReportTy->getPointerTo());
+    B.CreateCall(ReportTy, Report, B.CreateGlobalStringPtr(Name));
+    B.CreateUnreachable();
+
+    auto H = addModule(std::move(M));
+    auto Sym = CompileLayer.findSymbolIn(H, mangle(FnName), false);
+    assert(Sym && "Undefined function not found");
+    return cantFail(Sym.getAddress());
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -103,6 +632,10 @@ private:
     const bool ExportedSymbolsOnly = true;
 #endif
 
+    // A function that has a stub is always called through it.
+    if (auto Stub = StubsMgr->findStub(Name, ExportedSymbolsOnly))
+      return Stub;
+
     // Search modules in reverse order: from last added to first added.
     // This is the opposite of the usual search order for dlsym, but makes more
     // sense in a REPL where we want to bind to the newest available definition.
@@ -111,27 +644,55 @@ private:
         return Sym;
 
     // If we can't find the symbol in the JIT, try looking in the host process.
-    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
+    if (auto SymAddr = findHostSymbol(Name))
       return JITSymbol(SymAddr, JITSymbolFlags::Exported);
 
+    return nullptr;
+  }
+
+  /// findHostSymbol - The address of Name in the host process, or 0 if it has
+  /// none.  Searching the process asks every loaded library, so the result is
+  /// kept for the next module that uses Name, whether it was found or not.
+  JITTargetAddress findHostSymbol(const std::string &Name) {
+    auto Cached = HostSymbols.find(Name);
+    if (Cached != HostSymbols.end())
+      return Cached->second;
+
+    JITTargetAddress Addr =
+        RTDyldMemoryManager::getSymbolAddressInProcess(Name);
 #ifdef LLVM_ON_WIN32
     // For Windows retry without "_" at beginning, as RTDyldMemoryManager uses
     // GetProcAddress and standard libraries like msvcrt.dll use names
     // with and without "_" (for example "_itoa" but "sin").
-    if (Name.length() > 2 && Name[0] == '_')
-      if (auto SymAddr =
-              RTDyldMemoryManager::getSymbolAddressInProcess(Name.substr(1)))
-        return JITSymbol(SymAddr, JITSymbolFlags::Exported);
+    if (!Addr && Name.length() > 2 && Name[0] == '_')
+      Addr = RTDyldMemoryManager::getSymbolAddressInProcess(Name.substr(1));
 #endif
-
-    return nullptr;
+    HostSymbols[Name] = Addr;
+    return Addr;
   }
 
+  // Recursive, because linking a module looks up the symbols it uses.
+  std::recursive_mutex Lock;
+  /// UndefinedContext - The context of the modules of addUndefinedFunction.
+  LLVMContext UndefinedContext;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
+  std::unique_ptr<SectionMemoryManager::MemoryMapper> NearMemory;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
   std::vector<ModuleHandleT> ModuleHandles;
+  std::vector<JITEventListener *> EventListeners;
+  /// FreeingListeners - The EventListeners to tell about freed objects.
+  std::vector<JITEventListener *> FreeingListeners;
+  std::vector<LoadedObject> LoadedObjects;
+  /// HostSymbols - The addresses given to addHostSymbol or found by
+  /// findHostSymbol, 0 for the names that the process does not have.
+  std::map<std::string, JITTargetAddress> HostSymbols;
+  /// DeclaredFunctions - The names given to declareFunction, by mangled name.
+  std::map<std::string, std::string> DeclaredFunctions;
+  /// UndefinedStubs - The stubs that still point at addUndefinedFunction code.
+  std::set<std::string> UndefinedStubs;
 };
 
 } // end namespace orc
@@ -57,4 +57,13 @@ endmacro(SET_LLVM_LINK_CONFIG)
 macro(SET_CMAKE_PARAMETER)
     set(CMAKE_C_LINK_EXECUTABLE "/usr/bin/clang++")
     set(CMAKE_CXX_COMPILER "/usr/bin/clang++")
-endmacro(SET_CMAKE_PARAMETER)
\ No newline at end of file
+endmacro(SET_CMAKE_PARAMETER)
+
+# Adds the target bench_<TARGET>, which runs the corpus in bench/ with the
+# executable TARGET and prints the times as JSON.
+macro(ADD_BENCH_TARGET TARGET)
+    add_custom_target(bench_${TARGET}
+        COMMAND ${CMAKE_CURRENT_SOURCE_DIR}/../bench/run.sh $<TARGET_FILE:${TARGET}>
+        DEPENDS ${TARGET}
+        USES_TERMINAL)
+endmacro(ADD_BENCH_TARGET)
@@ -0,0 +1,246 @@
+// MIT License
+//
+// Copyright (c) 2020 sonson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT W  ARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compares MCJIT (jit_mc.cpp) and ORC LLJIT (jit_orc_lljit.cpp) on the same
+// generated code: n copies of originalFunction, f<i>(a, b) = a + b + i.
+//
+// For every n in 1, 10, 100, ... up to -max-functions, each engine reports
+//   construct_us        creating an empty engine
+//   add_materialize_us  adding the modules and getting the address of every
+//                       function, i.e. the time until all n are callable
+//   lookup_ns           getting the address of an already compiled function
+//   call_ns             calling a compiled function through a pointer
+// as one CSV line on stdout.  Every value is the fastest of -repeat runs.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/TargetSelect.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned> MaxFunctions("max-functions",
+    cl::desc("Largest number of generated functions"), cl::init(10000));
+static cl::opt<unsigned> Repeat("repeat",
+    cl::desc("Runs per measurement, the fastest is reported"), cl::init(3));
+static cl::opt<unsigned> Calls("calls",
+    cl::desc("Calls made to measure the call overhead"), cl::init(1000000));
+static cl::opt<bool> ModulePerFunction("module-per-function",
+    cl::desc("Put every function in its own module, as Kaleidoscope does"),
+    cl::init(false));
+
+typedef std::chrono::steady_clock Clock;
+typedef double (*BinaryFunction)(double, double);
+
+static double elapsedNs(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+struct Sample {
+    double construct;
+    double addMaterialize;
+    double lookup;
+    double call;
+};
+
+static std::string functionName(unsigned i) {
+    return "f" + std::to_string(i);
+}
+
+// define double @f<i>(double %a, double %b) {
+// entry:
+//   %addtmp = fadd double %a, %b
+//   %addtmp1 = fadd double %addtmp, <i>
+//   ret double %addtmp1
+// }
+static std::vector<std::unique_ptr<Module>> makeModules(LLVMContext &context, unsigned n) {
+    std::vector<std::unique_ptr<Module>> modules;
+    IRBuilder<> builder(context);
+    std::vector<Type *> Doubles(2, Type::getDoubleTy(context));
+    FunctionType *functionType = FunctionType::get(Type::getDoubleTy(context), Doubles, false);
+
+    for (unsigned i = 0; i < n; i++) {
+        if (modules.empty() || ModulePerFunction)
+            modules.push_back(std::make_unique<Module>("module" + std::to_string(i), context));
+        Function *function = Function::Create(functionType, Function::ExternalLinkage,
+                                              functionName(i), modules.back().get());
+        Value *a = function->getArg(0);
+        Value *b = function->getArg(1);
+
+        builder.SetInsertPoint(BasicBlock::Create(context, "entry", function));
+        auto sum = builder.CreateFAdd(a, b, "addtmp");
+        builder.CreateRet(builder.CreateFAdd(sum, ConstantFP::get(context, APFloat((double)i)), "addtmp"));
+    }
+    for (auto &module : modules) {
+        if (verifyModule(*module, &errs())) {
+            std::cerr << "Error module!" << std::endl;
+            exit(1);
+        }
+    }
+    return modules;
+}
+
+// Checks that every function computes what it should, then measures the call
+// overhead.  The result of each call feeds the next one, so the calls can not
+// overlap.
+static double measureCalls(const std::vector<BinaryFunction> &functions) {
+    for (unsigned i = 0; i < functions.size(); i++) {
+        if (functions[i](1.0, 2.0) != 3.0 + i) {
+            std::cerr << "error: " << functionName(i) << " returned a wrong value" << std::endl;
+            exit(1);
+        }
+    }
+
+    double value = 0;
+    auto start = Clock::now();
+    for (unsigned i = 0, j = 0; i < Calls; i++) {
+        value = functions[j](value, 1.0);
+        if (++j == functions.size())
+            j = 0;
+    }
+    double ns = elapsedNs(start) / Calls;
+    if (value < 0)
+        std::cerr << value << std::endl;
+    return ns;
+}
+
+static Sample runMCJIT(unsigned n) {
+    Sample sample;
+    LLVMContext context;
+    auto modules = makeModules(context, n);
+
+    auto start = Clock::now();
+    std::string errStr;
+    std::unique_ptr<ExecutionEngine> engine(EngineBuilder(std::make_unique<Module>("empty", context))
+        .setEngineKind(EngineKind::JIT)
+        .setErrorStr(&errStr)
+        .create());
+    if (!engine) {
+        std::cerr << "error: " << errStr << std::endl;
+        exit(1);
+    }
+    sample.construct = elapsedNs(start);
+
+    for (auto &module : modules)
+        module->setDataLayout(engine->getDataLayout());
+
+    // The first getFunctionAddress compiles every module added so far.
+    std::vector<BinaryFunction> functions(n);
+    start = Clock::now();
+    for (auto &module : modules)
+        engine->addModule(std::move(module));
+    for (unsigned i = 0; i < n; i++)
+        functions[i] = reinterpret_cast<BinaryFunction>(engine->getFunctionAddress(functionName(i)));
+    sample.addMaterialize = elapsedNs(start);
+
+    start = Clock::now();
+    for (unsigned i = 0; i < n; i++)
+        if (engine->getFunctionAddress(functionName(i)) != reinterpret_cast<uint64_t>(functions[i]))
+            exit(1);
+    sample.lookup = elapsedNs(start) / n;
+
+    sample.call = measureCalls(functions);
+    return sample;
+}
+
+static Sample runLLJIT(unsigned n) {
+    Sample sample;
+    orc::ThreadSafeContext context(std::make_unique<LLVMContext>());
+    auto modules = makeModules(*context.getContext(), n);
+
+    auto start = Clock::now();
+    auto jit = ExitOnError("LLJIT can not be initialized: ")(orc::LLJITBuilder().create());
+    sample.construct = elapsedNs(start);
+
+    for (auto &module : modules)
+        module->setDataLayout(jit->getDataLayout());
+
+    // addIRModule only registers the symbols.  Each module is compiled when
+    // one of its symbols is looked up for the first time.
+    std::vector<BinaryFunction> functions(n);
+    start = Clock::now();
+    for (auto &module : modules)
+        ExitOnError("LLJIT can not add the module: ")(
+            jit->addIRModule(orc::ThreadSafeModule(std::move(module), context)));
+    for (unsigned i = 0; i < n; i++) {
+        auto symbol = ExitOnError("Lookup failed: ")(jit->lookup(functionName(i)));
+        functions[i] = reinterpret_cast<BinaryFunction>(symbol.getAddress());
+    }
+    sample.addMaterialize = elapsedNs(start);
+
+    start = Clock::now();
+    for (unsigned i = 0; i < n; i++) {
+        auto symbol = ExitOnError("Lookup failed: ")(jit->lookup(functionName(i)));
+        if (symbol.getAddress() != reinterpret_cast<uint64_t>(functions[i]))
+            exit(1);
+    }
+    sample.lookup = elapsedNs(start) / n;
+
+    sample.call = measureCalls(functions);
+    return sample;
+}
+
+static void report(const char *engine, unsigned n, Sample (*run)(unsigned)) {
+    Sample best = run(n);
+    for (unsigned i = 1; i < Repeat; i++) {
+        Sample sample = run(n);
+        best.construct = std::min(best.construct, sample.construct);
+        best.addMaterialize = std::min(best.addMaterialize, sample.addMaterialize);
+        best.lookup = std::min(best.lookup, sample.lookup);
+        best.call = std::min(best.call, sample.call);
+    }
+    unsigned modules = ModulePerFunction ? n : 1;
+    printf("%s,%u,%u,%.1f,%.1f,%.1f,%.2f\n", engine, n, modules,
+           best.construct / 1000, best.addMaterialize / 1000, best.lookup, best.call);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    InitLLVM X(argc, argv);
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+    cl::ParseCommandLineOptions(argc, argv, "MCJIT vs ORC LLJIT\n");
+
+    printf("engine,functions,modules,construct_us,add_materialize_us,lookup_ns,call_ns\n");
+    for (unsigned n = 1; n <= MaxFunctions; n *= 10) {
+        report("mcjit", n, runMCJIT);
+        report("lljit", n, runLLJIT);
+    }
+    return 0;
+}